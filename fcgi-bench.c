@@ -0,0 +1,840 @@
+/*******************************************************************************/
+/*  The fcgi-bench program:                                                    */
+/*     - sends FCGI requests to a daemon, e.g., fcgi-launch, over N            */
+/*       connections at the same time                                          */
+/*     - verifies the FCGI_STDOUT and FCGI_END_REQUEST of each response        */
+/*     - reports the throughput, and the latency percentiles                   */
+/*                                                                             */
+/*  The requests are either replayed from captured fixtures, e.g.,             */
+/*  "fcgi-simple.request", or synthesized with a number of PARAMS and a body.  */
+/*  Each connection keeps M requests in flight: a request is sent as soon as   */
+/*  an earlier one has ended, i.e., the load is closed-loop.                   */
+/*                                                                             */
+/*  Usage:  fcgi-bench [-c N] [-m M] [-n COUNT | -t SECONDS] [-1] [-s]         */
+/*                     [-f FIXTURE]... [-p COUNT] [-b BYTES]                    */
+/*                     [-a STATUS] [-x FILE | -X] [-S SOCKET] ADDR PORT | PATH  */
+/*     -c:  the connections (default: 10)                                      */
+/*     -m:  the requests in flight on each connection (default: 1)             */
+/*     -n:  send COUNT requests (default: 1000)                                */
+/*     -t:  ... or send requests for SECONDS                                   */
+/*     -1:  a new connection for each request, i.e., without FCGI_KEEP_CONN    */
+/*     -s:  send SCGI requests instead, i.e., a connection for each request,   */
+/*          e.g., to fcgi-launch -s                                            */
+/*     -f:  replay the requests of the FIXTURE, in turn                        */
+/*     -p:  otherwise, synthesize requests with COUNT additional PARAMS        */
+/*     -b:  ... and a body of BYTES                                            */
+/*     -a:  the expected appStatus (default: 0)                                */
+/*     -x:  the expected FCGI_STDOUT of each request is the content of FILE    */
+/*          (for SCGI, the response)                                           */
+/*     -X:  ... or ends with the body of the request, e.g., an echo program    */
+/*     -S:  once done, print the statistics sent by the daemon's Unix SOCKET,  */
+/*          see fcgi-launch -U, after its spawn latency, and the system calls  */
+/*          of its event loop per request, e.g., with and without -u           */
+/*  The daemon listens on ADDR:PORT, or on the Unix socket PATH.               */
+/*                                                                             */
+/*  The exit status is 0 only if every response is as expected.                */
+/*                                                                             */
+/*  Build:  cc -o fcgi-bench fcgi-bench.c fcgi-buffer.c                        */
+/*                                                                             */
+/*******************************************************************************/
+
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#include "fcgi-daemon.h"
+
+
+#define MAX_TEMPLATES    (256)
+#define MAX_EVENTS       (64)
+#define RECEIVE_SIZE     (64 * 1024)
+
+
+// A request to be sent, e.g., one of the requests of a fixture
+typedef struct {
+  int role;
+  fcgi_buffer params;           // The content of the FCGI_PARAMS records
+  fcgi_buffer body;             // The content of the FCGI_STDIN records
+} bench_template;
+
+// A request in flight: its requestId is its index + 1
+typedef struct {
+  int active;
+  const bench_template * template;
+  long long started;            // In microseconds, see now
+  fcgi_buffer stdout_data;      // Kept only to be verified, see -x and -X
+  int stdout_ended;             // The empty FCGI_STDOUT record was received
+} bench_slot;
+
+typedef struct {
+  int fd;                       // -1 between connections
+  int connecting;
+  int events;                   // The epoll events of interest
+  fcgi_buffer in;
+  fcgi_buffer out;
+  int active;                   // The slots in flight
+  bench_slot * slots;
+} bench_connection;
+
+
+static bench_template templates[MAX_TEMPLATES];
+static int template_count = 0;
+static int next_template = 0;
+
+static int connections = 10;
+static int in_flight = 1;
+static long long request_limit = 1000;
+static long long duration = 0;        // In microseconds, instead of request_limit
+static int keep_conn = NONZERO;
+static int scgi = ZERO;
+static int expected_status = 0;
+static fcgi_buffer expected_stdout;
+static int expect_stdout = ZERO;
+static int expect_echo = ZERO;
+
+static struct sockaddr_storage address;
+static socklen_t address_length;
+
+static int epoll_fd;
+static long long deadline;
+static long long issued = 0;          // The requests that have been sent
+static long long completed = 0;       // ... and whose response is as expected
+static long long failed = 0;
+static long long bytes_in = 0;
+static long long bytes_out = 0;
+
+static long long * latencies = NULL;  // Of the completed requests, in microseconds
+static size_t latency_size = 0;
+
+
+static void usage(void) {
+  fprintf(stderr, "Usage: fcgi-bench [-c N] [-m M] [-n COUNT | -t SECONDS] [-1] [-s] [-f FIXTURE]... [-p COUNT] [-b BYTES]\n"
+                  "                  [-a STATUS] [-x FILE | -X] [-S SOCKET] ADDR PORT | PATH\n");
+  exit(1);
+}
+
+
+static long long number(char * arg, long long min, long long max) {
+  char * end;
+  long long value;
+
+  value = strtoll(arg, &end, 10);
+  if (*arg == '\0' || *end != '\0' || value < min || value > max) usage();
+  return value;
+}
+
+
+static long long now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static void failure(const char * reason, int request_id) {
+  failed ++;
+  if (failed <= 10) fprintf(stderr, "fcgi-bench: request %d: %s\n", request_id, reason);
+}
+
+
+
+/*******************************************************************************/
+/* The requests                                                                */
+/*******************************************************************************/
+static int read_file(const char * path, fcgi_buffer * buffer) {
+  BYTE * p;
+  ssize_t count;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  return_error(fd < 0, RETVAL_OTHER);
+
+  for (;;) {
+    p = buffer_reserve(buffer, RECEIVE_SIZE);
+    if (p == NULL) break;
+    count = read(fd, p, RECEIVE_SIZE);
+    if (count <= 0) break;
+    buffer_commit(buffer, count);
+  }
+  close(fd);
+  return (p == NULL || count < 0) ? RETVAL_OTHER : RETVAL_SUCCESS;
+}
+
+
+// Each request of the fixture, from its FCGI_BEGIN_REQUEST to its empty FCGI_STDIN
+static void load_fixture(const char * path) {
+  static bench_template * by_id[65536];
+  fcgi_buffer file = { NULL, 0, 0, 0 };
+  const FCGI_Header * header;
+  const BYTE * p;
+  const BYTE * end;
+  int request_id;
+  int content_length;
+
+  if (read_file(path, &file) != RETVAL_SUCCESS) {
+    fprintf(stderr, "Error: unable to read %s\n", path);
+    exit(1);
+  }
+  memset(by_id, ZERO, sizeof(by_id));
+
+  p = buffer_data(&file);
+  end = p + buffer_length(&file);
+  while (end - p >= (ssize_t) FCGI_HEADER_LEN) {
+    header = (const FCGI_Header *) p;
+    request_id = (header->requestIdB1 << 8) | header->requestIdB0;
+    content_length = (header->contentLengthB1 << 8) | header->contentLengthB0;
+    if (header->version != FCGI_VERSION_1 || end - p < (ssize_t) FCGI_HEADER_LEN + content_length + header->paddingLength) break;
+    p += FCGI_HEADER_LEN;
+
+    if (header->type == FCGI_BEGIN_REQUEST && content_length == sizeof(FCGI_BeginRequestBody)
+        && template_count < MAX_TEMPLATES) {
+      const FCGI_BeginRequestBody * body = (const FCGI_BeginRequestBody *) p;
+
+      by_id[request_id] = &templates[template_count++];
+      by_id[request_id]->role = (body->roleB1 << 8) | body->roleB0;
+    } else if (by_id[request_id] != NULL && header->type == FCGI_PARAMS) {
+      buffer_append(&by_id[request_id]->params, p, content_length);
+    } else if (by_id[request_id] != NULL && header->type == FCGI_STDIN) {
+      buffer_append(&by_id[request_id]->body, p, content_length);
+      if (content_length == 0) by_id[request_id] = NULL;
+    }
+    p += content_length + header->paddingLength;
+  }
+  buffer_free(&file);
+}
+
+
+static void encode_pair(fcgi_buffer * buffer, const char * name, const char * value) {
+  size_t lengths[2] = { strlen(name), strlen(value) };
+  BYTE length[4];
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    if (lengths[i] < 0x80) {
+      length[0] = (BYTE) lengths[i];
+      buffer_append(buffer, length, 1);
+    } else {
+      length[0] = (BYTE) ((lengths[i] >> 24) | 0x80);
+      length[1] = (BYTE) (lengths[i] >> 16);
+      length[2] = (BYTE) (lengths[i] >> 8);
+      length[3] = (BYTE) lengths[i];
+      buffer_append(buffer, length, 4);
+    }
+  }
+  buffer_append(buffer, name, lengths[0]);
+  buffer_append(buffer, value, lengths[1]);
+}
+
+
+static void synthesize(int param_count, size_t body_size) {
+  bench_template * t = &templates[template_count++];
+  char name[48];
+  char value[32];
+  size_t i;
+
+  t->role = FCGI_RESPONDER;
+
+  snprintf(value, sizeof(value), "%zu", body_size);
+  encode_pair(&t->params, "GATEWAY_INTERFACE", "CGI/1.1");
+  encode_pair(&t->params, "SERVER_PROTOCOL", "HTTP/1.1");
+  encode_pair(&t->params, "REQUEST_METHOD", (body_size == 0) ? "GET" : "POST");
+  encode_pair(&t->params, "SCRIPT_NAME", "/fcgi-bench");
+  encode_pair(&t->params, "QUERY_STRING", "");
+  encode_pair(&t->params, "CONTENT_LENGTH", value);
+  for (i = 0; i < (size_t) param_count; i++) {
+    snprintf(name, sizeof(name), "HTTP_X_BENCH_%zu", i);
+    encode_pair(&t->params, name, "abcdefghijklmnopqrstuvwxyz012345");
+  }
+
+  for (i = 0; i < body_size; i++) {
+    BYTE c = (BYTE) ('a' + i % 26);
+    buffer_append(&t->body, &c, 1);
+  }
+}
+
+
+static void write_record(fcgi_buffer * out, int type, int request_id, const BYTE * content, size_t length) {
+  FCGI_Header header;
+
+  header.version = FCGI_VERSION_1;
+  header.type = type;
+  header.requestIdB1 = (BYTE) (request_id >> 8);
+  header.requestIdB0 = (BYTE) request_id;
+  header.contentLengthB1 = (BYTE) (length >> 8);
+  header.contentLengthB0 = (BYTE) length;
+  header.paddingLength = 0;
+  header.reserved = 0;
+
+  buffer_append(out, &header, FCGI_HEADER_LEN);
+  if (length != 0) buffer_append(out, content, length);
+}
+
+
+// Write a stream, e.g., FCGI_PARAMS, as records of at most FCGI_MAX_CONTENT_LEN
+static void write_stream(fcgi_buffer * out, int type, int request_id, const fcgi_buffer * content) {
+  const BYTE * p = buffer_data(content);
+  size_t length = buffer_length(content);
+  size_t count;
+
+  for (; length != 0; p += count, length -= count) {
+    count = (length > FCGI_MAX_CONTENT_LEN) ? FCGI_MAX_CONTENT_LEN : length;
+    write_record(out, type, request_id, p, count);
+  }
+  write_record(out, type, request_id, NULL, 0);
+}
+
+
+
+/*******************************************************************************/
+/* The connections                                                             */
+/*******************************************************************************/
+static int more_requests(void) {
+  return (duration != 0) ? now() < deadline : issued < request_limit;
+}
+
+
+static void update_events(bench_connection * conn) {
+  struct epoll_event event;
+  int events = EPOLLIN;
+
+  if (conn->connecting || buffer_length(&conn->out) != 0) events |= EPOLLOUT;
+  if (events == conn->events) return;
+
+  event.events = events;
+  event.data.ptr = conn;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+  conn->events = events;
+}
+
+
+// The SCGI request: a netstring of the PARAMS, CONTENT_LENGTH first, and the body
+static void write_scgi(fcgi_buffer * out, const bench_template * t) {
+  fcgi_buffer headers = { NULL, 0, 0, 0 };
+  const BYTE * p = buffer_data(&t->params);
+  const BYTE * end = p + buffer_length(&t->params);
+  size_t lengths[2];
+  char number[32];
+  int i;
+
+  snprintf(number, sizeof(number), "%zu", buffer_length(&t->body));
+  buffer_append(&headers, "CONTENT_LENGTH", 15);
+  buffer_append(&headers, number, strlen(number) + 1);
+  buffer_append(&headers, "SCGI\0" "1", 7);
+
+  while (p < end) {
+    for (i = 0; i < 2 && p < end; i++) {
+      if (*p < 0x80) {
+        lengths[i] = *p++;
+      } else {
+        if (end - p < 4) return;
+        lengths[i] = ((size_t) (p[0] & 0x7F) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        p += 4;
+      }
+    }
+    if (i != 2 || (size_t) (end - p) < lengths[0] + lengths[1]) break;
+
+    if (! (lengths[0] == 14 && memcmp(p, "CONTENT_LENGTH", 14) == 0)
+        && ! (lengths[0] == 4 && memcmp(p, "SCGI", 4) == 0)) {
+      buffer_append(&headers, p, lengths[0]);
+      buffer_append(&headers, "", 1);
+      buffer_append(&headers, p + lengths[0], lengths[1]);
+      buffer_append(&headers, "", 1);
+    }
+    p += lengths[0] + lengths[1];
+  }
+
+  snprintf(number, sizeof(number), "%zu:", buffer_length(&headers));
+  buffer_append(out, number, strlen(number));
+  buffer_append(out, buffer_data(&headers), buffer_length(&headers));
+  buffer_append(out, ",", 1);
+  buffer_append(out, buffer_data(&t->body), buffer_length(&t->body));
+  buffer_free(&headers);
+}
+
+
+static void start_request(bench_connection * conn, int index) {
+  bench_slot * slot = &conn->slots[index];
+  const bench_template * t = &templates[next_template];
+  FCGI_BeginRequestBody begin;
+
+  next_template = (next_template + 1) % template_count;
+  issued ++;
+
+  slot->active = NONZERO;
+  slot->template = t;
+  slot->started = now();
+  slot->stdout_ended = ZERO;
+  slot->stdout_data.start = slot->stdout_data.end = 0;
+  conn->active ++;
+
+  if (scgi) {
+    write_scgi(&conn->out, t);
+    return;
+  }
+
+  memset(&begin, ZERO, sizeof(begin));
+  begin.roleB1 = (BYTE) (t->role >> 8);
+  begin.roleB0 = (BYTE) t->role;
+  begin.flags = keep_conn ? FCGI_KEEP_CONN : ZERO;
+
+  write_record(&conn->out, FCGI_BEGIN_REQUEST, index + 1, (BYTE *) &begin, sizeof(begin));
+  write_stream(&conn->out, FCGI_PARAMS, index + 1, &t->params);
+  write_stream(&conn->out, FCGI_STDIN, index + 1, &t->body);
+}
+
+
+static void open_connection(bench_connection * conn) {
+  struct epoll_event event;
+  int one = 1;
+  int i;
+
+  conn->fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (conn->fd < 0) {
+    perror("socket");
+    exit(1);
+  }
+  if (address.ss_family != AF_UNIX) setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  conn->connecting = NONZERO;
+  if (connect(conn->fd, (struct sockaddr *) &address, address_length) != 0 && errno != EINPROGRESS) {
+    perror("connect");
+    exit(1);
+  }
+
+  event.events = conn->events = EPOLLIN | EPOLLOUT;
+  event.data.ptr = conn;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &event);
+
+  for (i = 0; i < in_flight && more_requests(); i++) start_request(conn, i);
+}
+
+
+static void close_connection(bench_connection * conn) {
+  int i;
+
+  for (i = 0; i < in_flight; i++) {
+    if (! conn->slots[i].active) continue;
+    conn->slots[i].active = ZERO;
+    failure("the connection closed", i + 1);
+  }
+  conn->active = 0;
+
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  conn->fd = -1;
+  conn->connecting = ZERO;
+  conn->in.start = conn->in.end = 0;
+  conn->out.start = conn->out.end = 0;
+}
+
+
+// The request has ended: "error" is NULL, unless its end is not as expected
+static void finish_request(bench_connection * conn, int index, const char * error) {
+  bench_slot * slot = &conn->slots[index];
+  const fcgi_buffer * out = &slot->stdout_data;
+  const fcgi_buffer * in = &slot->template->body;
+
+  slot->active = ZERO;
+  conn->active --;
+
+  if (error == NULL && expect_stdout && (buffer_length(out) != buffer_length(&expected_stdout)
+      || memcmp(buffer_data(out), buffer_data(&expected_stdout), buffer_length(out)) != 0)) {
+    error = "unexpected FCGI_STDOUT";
+  }
+  if (error == NULL && expect_echo && (buffer_length(out) < buffer_length(in)
+      || memcmp(buffer_data(out) + buffer_length(out) - buffer_length(in), buffer_data(in), buffer_length(in)) != 0)) {
+    error = "FCGI_STDOUT does not end with the body";
+  }
+  if (error != NULL) {
+    failure(error, index + 1);
+    return;
+  }
+
+  if ((size_t) completed == latency_size) {
+    latency_size = (latency_size == 0) ? 4096 : latency_size * 2;
+    latencies = (long long *) realloc(latencies, latency_size * sizeof(long long));
+    exit_error(latencies == NULL, RETVAL_MEMORY_ERR);
+  }
+  latencies[completed++] = now() - slot->started;
+}
+
+
+static void end_request(bench_connection * conn, int index, const BYTE * content, int content_length) {
+  const FCGI_EndRequestBody * body = (const FCGI_EndRequestBody *) content;
+  int app_status;
+
+  if (content_length != sizeof(FCGI_EndRequestBody)) {
+    finish_request(conn, index, "invalid FCGI_END_REQUEST");
+    return;
+  }
+  app_status = (body->appStatusB3 << 24) | (body->appStatusB2 << 16) | (body->appStatusB1 << 8) | body->appStatusB0;
+
+  if (body->protocolStatus != FCGI_REQUEST_COMPLETE) {
+    finish_request(conn, index, "protocolStatus is not FCGI_REQUEST_COMPLETE");
+  } else if (app_status != expected_status) {
+    finish_request(conn, index, "unexpected appStatus");
+  } else if (! conn->slots[index].stdout_ended) {
+    finish_request(conn, index, "FCGI_STDOUT did not end before FCGI_END_REQUEST");
+  } else {
+    finish_request(conn, index, NULL);
+  }
+}
+
+
+// The SCGI response ends with the connection: a 503 means it was not served
+static void end_scgi(bench_connection * conn) {
+  const fcgi_buffer * out = &conn->slots[0].stdout_data;
+
+  if (buffer_length(out) == 0) {
+    finish_request(conn, 0, "empty response");
+  } else if (buffer_length(out) >= 11 && memcmp(buffer_data(out), "Status: 503", 11) == 0) {
+    finish_request(conn, 0, "Status: 503");
+  } else {
+    finish_request(conn, 0, NULL);
+  }
+}
+
+
+// Process each complete record of the input
+static int process_input(bench_connection * conn) {
+  const FCGI_Header * header;
+  const BYTE * content;
+  int request_id;
+  int content_length;
+  int index;
+  bench_slot * slot;
+
+  // SCGI: the response is the whole input, of which the start is kept
+  if (scgi) {
+    slot = &conn->slots[0];
+    if (expect_stdout || expect_echo || buffer_length(&slot->stdout_data) < 16) {
+      buffer_append(&slot->stdout_data, buffer_data(&conn->in), buffer_length(&conn->in));
+    }
+    buffer_consume(&conn->in, buffer_length(&conn->in));
+    return RETVAL_SUCCESS;
+  }
+
+  while (buffer_length(&conn->in) >= FCGI_HEADER_LEN) {
+    header = (const FCGI_Header *) buffer_data(&conn->in);
+    request_id = (header->requestIdB1 << 8) | header->requestIdB0;
+    content_length = (header->contentLengthB1 << 8) | header->contentLengthB0;
+    return_error(header->version != FCGI_VERSION_1, RETVAL_PROTOCOL_ERROR);
+    if (buffer_length(&conn->in) < (size_t) FCGI_HEADER_LEN + content_length + header->paddingLength) break;
+
+    content = buffer_data(&conn->in) + FCGI_HEADER_LEN;
+    index = request_id - 1;
+    return_error(index < 0 || index >= in_flight || ! conn->slots[index].active, RETVAL_ID_MISMATCH);
+    slot = &conn->slots[index];
+
+    switch (header->type) {
+    case FCGI_STDOUT:
+      return_error(slot->stdout_ended, RETVAL_PROTOCOL_ERROR);
+      if (content_length == 0) slot->stdout_ended = NONZERO;
+      else if (expect_stdout || expect_echo) buffer_append(&slot->stdout_data, content, content_length);
+      break;
+
+    case FCGI_STDERR:
+      break;
+
+    case FCGI_END_REQUEST:
+      end_request(conn, index, content, content_length);
+      if (keep_conn && more_requests()) start_request(conn, index);
+      break;
+
+    default:
+      return RETVAL_PROTOCOL_ERROR;
+    }
+    buffer_consume(&conn->in, FCGI_HEADER_LEN + content_length + header->paddingLength);
+  }
+  return RETVAL_SUCCESS;
+}
+
+
+static void connection_handler(bench_connection * conn, int events) {
+  BYTE * p;
+  ssize_t count;
+
+  if (conn->connecting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+
+    getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+    if (error != 0) {
+      fprintf(stderr, "fcgi-bench: connect: %s\n", strerror(error));
+      exit(1);
+    }
+    conn->connecting = ZERO;
+  }
+
+  while (! conn->connecting) {
+    p = buffer_reserve(&conn->in, RECEIVE_SIZE);
+    exit_error(p == NULL, RETVAL_MEMORY_ERR);
+
+    count = recv(conn->fd, p, RECEIVE_SIZE, ZERO);
+    if (count < 0 && errno == EINTR) continue;
+    if (count < 0 && errno == EAGAIN) break;
+    if (count <= 0) {
+      if (count == 0 && scgi && conn->active != 0) end_scgi(conn);
+      close_connection(conn);
+      break;
+    }
+    buffer_commit(&conn->in, count);
+    bytes_in += count;
+
+    if (process_input(conn) != RETVAL_SUCCESS) {
+      failure("invalid response", 0);
+      close_connection(conn);
+      break;
+    }
+    if ((size_t) count < RECEIVE_SIZE) break;
+  }
+
+  // The requests, including those started once an earlier one ended
+  while (conn->fd >= 0 && ! conn->connecting && buffer_length(&conn->out) != 0) {
+    count = send(conn->fd, buffer_data(&conn->out), buffer_length(&conn->out), MSG_NOSIGNAL);
+    if (count < 0) break;
+    buffer_consume(&conn->out, count);
+    bytes_out += count;
+  }
+
+  // Without FCGI_KEEP_CONN, each request has a connection of its own
+  if (conn->fd >= 0 && conn->active == 0 && ! keep_conn) close_connection(conn);
+
+  if (conn->fd < 0) {
+    if (more_requests()) open_connection(conn);
+    return;
+  }
+  update_events(conn);
+}
+
+
+
+/*******************************************************************************/
+/* The report                                                                  */
+/*******************************************************************************/
+static int compare(const void * a, const void * b) {
+  long long x = *(const long long *) a;
+  long long y = *(const long long *) b;
+
+  return (x > y) - (x < y);
+}
+
+
+static double percentile(double fraction) {
+  size_t rank = (size_t) (fraction * completed + 0.5);
+
+  if (rank < 1) rank = 1;
+  if (rank > (size_t) completed) rank = completed;
+  return latencies[rank - 1] / 1000.0;
+}
+
+
+static void report(long long elapsed) {
+  double seconds = elapsed / 1e6;
+
+  printf("requests:    %lld completed, %lld failed\n", completed, failed);
+  printf("elapsed:     %.3f s\n", seconds);
+  printf("throughput:  %.1f requests/s, %.2f MB/s in, %.2f MB/s out\n",
+         completed / seconds, bytes_in / seconds / 1e6, bytes_out / seconds / 1e6);
+  if (completed == 0) return;
+
+  qsort(latencies, completed, sizeof(long long), compare);
+  printf("latency ms:  min %.3f, p50 %.3f, p99 %.3f, p999 %.3f, max %.3f\n",
+         latencies[0] / 1000.0, percentile(0.5), percentile(0.99), percentile(0.999),
+         latencies[completed - 1] / 1000.0);
+}
+
+
+// Print the statistics of the daemon, see fcgi-launch -U
+// The number that follows "name" within the JSON, or -1
+static long long json_number(const char * json, const char * name) {
+  char key[64];
+  const char * p;
+
+  snprintf(key, sizeof(key), "\"%s\": ", name);
+  p = (json == NULL) ? NULL : strstr(json, key);
+  return (p == NULL) ? -1 : atoll(p + strlen(key));
+}
+
+
+// The statistics of the daemon, NUL-terminated, or an empty buffer
+static void fetch_stats(const char * path, fcgi_buffer * json) {
+  struct sockaddr_un addr;
+  BYTE * data;
+  ssize_t count;
+  int fd;
+
+  memset(&addr, ZERO, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+    fprintf(stderr, "fcgi-bench: unable to connect to %s\n", path);
+    if (fd >= 0) close(fd);
+    return;
+  }
+  while ((data = buffer_reserve(json, RECEIVE_SIZE + 1)) != NULL && (count = read(fd, data, RECEIVE_SIZE)) > 0) {
+    buffer_commit(json, count);
+  }
+  close(fd);
+  if (data == NULL) buffer_free(json);
+  if (buffer_length(json) != 0) buffer_data(json)[buffer_length(json)] = '\0';
+}
+
+
+// The statistics of the daemon, after the spawn latency, i.e., the cost of a
+// child as the daemon grows, see fcgi-spawn.c, and the system calls of its
+// event loop per request, since "before", e.g., to compare fcgi-launch -u
+static void report_daemon(const char * path, fcgi_buffer * before) {
+  fcgi_buffer json = { NULL, 0, 0, 0 };
+  const char * spawn;
+  const char * backend;
+  char * first;
+  char * last;
+  long long requests;
+
+  fetch_stats(path, &json);
+  if (buffer_length(&json) == 0) return;
+  last = (char *) buffer_data(&json);
+  first = (buffer_length(before) == 0) ? NULL : (char *) buffer_data(before);
+
+  spawn = strstr(last, "\"spawn\": {");
+  if (json_number(spawn, "count") > 0) {
+    printf("spawn us:    p50 %lld, p99 %lld, max %lld, over %lld spawns (daemon rss %lld kB)\n",
+           json_number(spawn, "p50"), json_number(spawn, "p99"), json_number(spawn, "max"),
+           json_number(spawn, "count"), json_number(last, "rss_kb"));
+  }
+
+  requests = json_number(last, "requests") - json_number(first, "requests");
+  backend = strstr(last, "\"event_backend\": \"");
+  if (first != NULL && backend != NULL && requests > 0) {
+    backend += strlen("\"event_backend\": \"");
+    printf("event loop:  %.*s, %.2f syscalls, %.2f changes per request\n", (int) strcspn(backend, "\""), backend,
+           (double) (json_number(last, "event_syscalls") - json_number(first, "event_syscalls")) / requests,
+           (double) (json_number(last, "event_changes") - json_number(first, "event_changes")) / requests);
+  }
+  fwrite(buffer_data(&json), 1, buffer_length(&json), stdout);
+  buffer_free(&json);
+}
+
+
+static void resolve(int argc, char * argv[]) {
+  struct addrinfo hints;
+  struct addrinfo * result;
+
+  if (argc == 1) {
+    struct sockaddr_un * addr = (struct sockaddr_un *) &address;
+
+    if (strlen(argv[0]) >= sizeof(addr->sun_path)) usage();
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, argv[0]);
+    address_length = sizeof(struct sockaddr_un);
+    return;
+  }
+
+  memset(&hints, ZERO, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(argv[0], argv[1], &hints, &result) != 0) {
+    fprintf(stderr, "Error: unable to resolve %s:%s\n", argv[0], argv[1]);
+    exit(1);
+  }
+  memcpy(&address, result->ai_addr, result->ai_addrlen);
+  address_length = result->ai_addrlen;
+  freeaddrinfo(result);
+}
+
+
+int main(int argc, char * argv[]) {
+  struct epoll_event events[MAX_EVENTS];
+  bench_connection * conns;
+  char * stats_socket = NULL;
+  fcgi_buffer stats_before = { NULL, 0, 0, 0 };
+  int param_count = 0;
+  size_t body_size = 0;
+  long long started;
+  int count;
+  int opt;
+  int i;
+
+  while ((opt = getopt(argc, argv, "c:m:n:t:1sf:p:b:a:x:XS:")) != -1) {
+    switch (opt) {
+    case 'c': connections = number(optarg, 1, 100000); break;
+    case 'm': in_flight = number(optarg, 1, 65535); break;
+    case 'n': request_limit = number(optarg, 1, 1LL << 62); break;
+    case 't': duration = number(optarg, 1, 86400) * 1000000; break;
+    case '1': keep_conn = ZERO; break;
+    case 's': scgi = NONZERO; keep_conn = ZERO; break;
+    case 'f': load_fixture(optarg); break;
+    case 'p': param_count = number(optarg, 0, 100000); break;
+    case 'b': body_size = number(optarg, 0, 1LL << 32); break;
+    case 'a': expected_status = number(optarg, -2147483647LL - 1, 2147483647LL); break;
+    case 'x':
+      if (read_file(optarg, &expected_stdout) != RETVAL_SUCCESS) {
+        fprintf(stderr, "Error: unable to read %s\n", optarg);
+        exit(1);
+      }
+      expect_stdout = NONZERO;
+      break;
+    case 'X': expect_echo = NONZERO; break;
+    case 'S': stats_socket = optarg; break;
+    default:  usage();
+    }
+  }
+  if (argc - optind != 1 && argc - optind != 2) usage();
+  resolve(argc - optind, argv + optind);
+
+  if (template_count == 0) synthesize(param_count, body_size);
+
+  // Without FCGI_KEEP_CONN, there is a single request per connection
+  if (! keep_conn) in_flight = 1;
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  conns = (bench_connection *) calloc(connections, sizeof(bench_connection));
+  exit_error(epoll_fd < 0 || conns == NULL, RETVAL_OTHER);
+
+  if (stats_socket != NULL) fetch_stats(stats_socket, &stats_before);
+
+  started = now();
+  deadline = started + duration;
+  for (i = 0; i < connections; i++) {
+    conns[i].slots = (bench_slot *) calloc(in_flight, sizeof(bench_slot));
+    exit_error(conns[i].slots == NULL, RETVAL_MEMORY_ERR);
+    conns[i].fd = -1;
+    if (more_requests()) open_connection(&conns[i]);
+  }
+
+  while (completed + failed < issued || more_requests()) {
+    count = epoll_wait(epoll_fd, events, MAX_EVENTS, 1000);
+    if (count < 0 && errno == EINTR) continue;
+    exit_error(count < 0, RETVAL_OTHER);
+
+    for (i = 0; i < count; i++) connection_handler((bench_connection *) events[i].data.ptr, events[i].events);
+  }
+
+  report(now() - started);
+  for (i = 0; i < connections; i++) {
+    if (conns[i].fd >= 0) close_connection(&conns[i]);
+  }
+  if (stats_socket != NULL) report_daemon(stats_socket, &stats_before);
+
+  exit((failed == 0 && completed != 0) ? 0 : 1);
+}
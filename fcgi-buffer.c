@@ -0,0 +1,79 @@
+/*******************************************************************************/
+/*  Byte buffers                                                               */
+/*     - data is appended at the "end", and consumed from the "start"          */
+/*     - space is reclaimed by moving the unconsumed data to the front          */
+/*                                                                             */
+/*  Buffers hold the input and output of a connection, and the FCGI_STDIN      */
+/*  data that is waiting to be sent to a child process.                        */
+/*                                                                             */
+/*******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fcgi-daemon.h"
+
+
+#define BUFFER_MIN_SIZE  (4096)
+
+
+/*******************************************************************************/
+/* Return a pointer to at least "count" bytes of free space after the data      */
+/*******************************************************************************/
+BYTE * buffer_reserve(fcgi_buffer * buffer, size_t count) {
+  size_t length = buffer->end - buffer->start;
+
+  if (buffer->size - buffer->end >= count) return buffer->data + buffer->end;
+
+  // Reclaim the consumed space, if that is enough
+  if (buffer->start != 0 && buffer->size - length >= count) {
+    memmove(buffer->data, buffer->data + buffer->start, length);
+    buffer->start = 0;
+    buffer->end = length;
+    return buffer->data + buffer->end;
+  }
+
+  {
+    size_t size = (buffer->size < BUFFER_MIN_SIZE) ? BUFFER_MIN_SIZE : buffer->size;
+    BYTE * data;
+
+    while (size - length < count) size *= 2;
+
+    if (buffer->start != 0) {
+      memmove(buffer->data, buffer->data + buffer->start, length);
+      buffer->start = 0;
+      buffer->end = length;
+    }
+    data = (BYTE *) realloc(buffer->data, size);
+    if (data == NULL) return NULL;
+
+    buffer->data = data;
+    buffer->size = size;
+  }
+  return buffer->data + buffer->end;
+}
+
+
+int buffer_append(fcgi_buffer * buffer, const void * data, size_t count) {
+  BYTE * p;
+
+  p = buffer_reserve(buffer, count);
+  return_error(p == NULL, RETVAL_MEMORY_ERR);
+
+  memcpy(p, data, count);
+  buffer->end += count;
+  return RETVAL_SUCCESS;
+}
+
+
+void buffer_consume(fcgi_buffer * buffer, size_t count) {
+  buffer->start += count;
+  if (buffer->start == buffer->end) buffer->start = buffer->end = 0;
+}
+
+
+void buffer_free(fcgi_buffer * buffer) {
+  free(buffer->data);
+  buffer->data = NULL;
+  buffer->start = buffer->end = buffer->size = 0;
+}
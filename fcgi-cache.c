@@ -0,0 +1,269 @@
+/*******************************************************************************/
+/*  Caches of responses:                                                       */
+/*     - each entry holds a key and its data, e.g., the FCGI_STDOUT of a       */
+/*       request and its appStatus, keyed on some of its FCGI_PARAMS           */
+/*     - an entry expires after its time to live                               */
+/*     - the memory of all entries is limited to a budget: the least recently  */
+/*       used entries are evicted to make room for a new one                   */
+/*                                                                             */
+/*  The freshness of a CGI response is determined by its headers, see          */
+/*  cache_response_ttl.                                                        */
+/*                                                                             */
+/*******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "fcgi-daemon.h"
+
+
+#define CACHE_MIN_BUCKETS   (256)
+
+#define entry_size(e)       (sizeof(fcgi_cache_entry) + (e)->key_length + (e)->data_length)
+
+
+static unsigned hash_key(const BYTE * key, size_t key_length) {
+  unsigned hash = 2166136261u;          // FNV-1a
+  size_t i;
+
+  for (i = 0; i < key_length; i++) {
+    hash ^= key[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+
+void cache_init(fcgi_cache * cache, size_t budget) {
+  memset(cache, ZERO, sizeof(fcgi_cache));
+  cache->budget = budget;
+}
+
+
+
+/*******************************************************************************/
+/* The least recently used list, newest first                                  */
+/*******************************************************************************/
+static void unlink_lru(fcgi_cache * cache, fcgi_cache_entry * entry) {
+  if (entry->newer != NULL) entry->newer->older = entry->older;
+  else cache->newest = entry->older;
+  if (entry->older != NULL) entry->older->newer = entry->newer;
+  else cache->oldest = entry->newer;
+}
+
+
+static void link_newest(fcgi_cache * cache, fcgi_cache_entry * entry) {
+  entry->newer = NULL;
+  entry->older = cache->newest;
+  if (cache->newest != NULL) cache->newest->newer = entry;
+  else cache->oldest = entry;
+  cache->newest = entry;
+}
+
+
+static void remove_entry(fcgi_cache * cache, fcgi_cache_entry * entry) {
+  fcgi_cache_entry ** p;
+
+  for (p = &cache->buckets[entry->hash & (cache->bucket_count - 1)]; *p != NULL; p = &(*p)->next) {
+    if (*p == entry) { *p = entry->next; break; }
+  }
+  unlink_lru(cache, entry);
+
+  cache->size -= entry_size(entry);
+  cache->count --;
+  free(entry);
+}
+
+
+// Double the buckets, once there are more entries than buckets
+static void grow_buckets(fcgi_cache * cache) {
+  fcgi_cache_entry ** buckets;
+  fcgi_cache_entry * entry;
+  fcgi_cache_entry * next;
+  size_t count;
+  size_t i;
+
+  count = (cache->bucket_count == 0) ? CACHE_MIN_BUCKETS : cache->bucket_count * 2;
+  buckets = (fcgi_cache_entry **) calloc(count, sizeof(fcgi_cache_entry *));
+  if (buckets == NULL) return;
+
+  for (i = 0; i < cache->bucket_count; i++) {
+    for (entry = cache->buckets[i]; entry != NULL; entry = next) {
+      next = entry->next;
+      entry->next = buckets[entry->hash & (count - 1)];
+      buckets[entry->hash & (count - 1)] = entry;
+    }
+  }
+  free(cache->buckets);
+  cache->buckets = buckets;
+  cache->bucket_count = count;
+}
+
+
+
+/*******************************************************************************/
+/* Return the fresh entry for the key, or NULL                                 */
+/*******************************************************************************/
+fcgi_cache_entry * cache_lookup(fcgi_cache * cache, const BYTE * key, size_t key_length) {
+  fcgi_cache_entry * entry;
+  unsigned hash;
+
+  if (cache->bucket_count == 0) {
+    cache->misses ++;
+    return NULL;
+  }
+
+  hash = hash_key(key, key_length);
+  for (entry = cache->buckets[hash & (cache->bucket_count - 1)]; entry != NULL; entry = entry->next) {
+    if (entry->hash == hash && entry->key_length == key_length && memcmp(entry->data, key, key_length) == 0) break;
+  }
+
+  if (entry != NULL && entry->expires <= event_now()) {
+    remove_entry(cache, entry);
+    entry = NULL;
+  }
+  if (entry == NULL) {
+    cache->misses ++;
+    return NULL;
+  }
+
+  unlink_lru(cache, entry);
+  link_newest(cache, entry);
+  cache->hits ++;
+  return entry;
+}
+
+
+/*******************************************************************************/
+/* Insert, or replace, the entry for the key; "ttl" is in milliseconds         */
+/*******************************************************************************/
+fcgi_cache_entry * cache_insert(fcgi_cache * cache, const BYTE * key, size_t key_length,
+                                const BYTE * data, size_t data_length, int status, long long ttl) {
+  fcgi_cache_entry * entry;
+  fcgi_cache_entry * old;
+  size_t size = sizeof(fcgi_cache_entry) + key_length + data_length;
+
+  if (ttl <= 0 || size > cache->budget) return NULL;
+
+  if (cache->count >= cache->bucket_count) grow_buckets(cache);
+  if (cache->bucket_count == 0) return NULL;
+
+  entry = (fcgi_cache_entry *) malloc(size);
+  if (entry == NULL) return NULL;
+
+  entry->hash = hash_key(key, key_length);
+  entry->expires = event_now() + ttl;
+  entry->status = status;
+  entry->key_length = key_length;
+  entry->data_length = data_length;
+  memcpy(entry->data, key, key_length);
+  memcpy(entry->data + key_length, data, data_length);
+
+  for (old = cache->buckets[entry->hash & (cache->bucket_count - 1)]; old != NULL; old = old->next) {
+    if (old->hash == entry->hash && old->key_length == key_length && memcmp(old->data, key, key_length) == 0) {
+      remove_entry(cache, old);
+      break;
+    }
+  }
+
+  // Make room: the least recently used entries go first.  Expired entries
+  // are otherwise removed once they are looked up.
+  while (cache->size + size > cache->budget && cache->oldest != NULL) {
+    remove_entry(cache, cache->oldest);
+    cache->evictions ++;
+  }
+
+  entry->next = cache->buckets[entry->hash & (cache->bucket_count - 1)];
+  cache->buckets[entry->hash & (cache->bucket_count - 1)] = entry;
+  link_newest(cache, entry);
+
+  cache->size += size;
+  cache->count ++;
+  return entry;
+}
+
+
+
+/*******************************************************************************/
+/* The freshness of a CGI response, in milliseconds, per its headers:          */
+/*    - Status, other than 200, and Set-Cookie: not cached                     */
+/*    - Cache-Control: no-store, no-cache and private: not cached              */
+/*    - Cache-Control: s-maxage, then max-age: the time to live                */
+/*    - Expires: the time to live, unless Cache-Control provides it            */
+/*    - otherwise: "ttl", the default                                          */
+/*  Returns 0 if the response is not to be cached.                             */
+/*******************************************************************************/
+#define is_header(h)   (name_length == strlen(h) && strncasecmp(line, h, name_length) == 0)
+
+
+// The value of the directive within the Cache-Control header, or -1
+static long long directive(const char * value, const char * end, const char * name) {
+  size_t length = strlen(name);
+  const char * p;
+
+  for (p = value; p + length <= end; p++) {
+    if (strncasecmp(p, name, length) != 0) continue;
+    if (p != value && p[-1] != ' ' && p[-1] != ',' && p[-1] != '\t') continue;
+
+    if (p + length == end || p[length] == ',' || p[length] == ' ' || p[length] == '\r') return 0;
+    if (p[length] == '=') return atoll(p + length + 1);
+  }
+  return -1;
+}
+
+
+long long cache_response_ttl(const BYTE * response, size_t length, long long ttl) {
+  const char * line = (const char *) response;
+  const char * end = line + length;
+  const char * eol;
+  const char * value;
+  size_t name_length;
+  long long max_age = -1;
+  long long s_maxage = -1;
+  long long expires = -1;
+
+  for (;;) {
+    eol = memchr(line, '\n', end - line);
+    if (eol == NULL) return 0;                  // The headers are incomplete
+
+    // The blank line ends the headers
+    if (eol == line || (eol == line + 1 && line[0] == '\r')) break;
+
+    value = memchr(line, ':', eol - line);
+    if (value != NULL) {
+      name_length = value - line;
+      for (value++; value < eol && (*value == ' ' || *value == '\t'); value++) ;
+
+      if (is_header("Status") && strncmp(value, "200", 3) != 0) return 0;
+      if (is_header("Set-Cookie")) return 0;
+
+      if (is_header("Cache-Control")) {
+        if (directive(value, eol, "no-store") >= 0 || directive(value, eol, "no-cache") >= 0
+            || directive(value, eol, "private") >= 0) return 0;
+        if (max_age < 0) max_age = directive(value, eol, "max-age");
+        if (s_maxage < 0) s_maxage = directive(value, eol, "s-maxage");
+      }
+
+      if (is_header("Expires")) {
+        struct tm tm;
+        const char * parsed;
+
+        memset(&tm, ZERO, sizeof(tm));
+        parsed = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        if (parsed == NULL) return 0;           // An invalid date means "already expired"
+        expires = (long long) (timegm(&tm) - time(NULL)) * 1000;
+        if (expires <= 0) return 0;
+      }
+    }
+    line = eol + 1;
+  }
+
+  if (s_maxage >= 0) return s_maxage * 1000;
+  if (max_age >= 0)  return max_age * 1000;
+  if (expires >= 0)  return expires;
+  return ttl;
+}
@@ -0,0 +1,998 @@
+/*******************************************************************************/
+/*  FCGI connections:                                                          */
+/*     - receives the records sent by the Web server                           */
+/*     - tracks each of the requests on the connection by its requestId        */
+/*     - dispatches the records of a request to its role, see                  */
+/*       "fcgi-responder.c"                                                    */
+/*     - sends the records produced by each request back to the Web server     */
+/*                                                                             */
+/*******************************************************************************/
+/* FCGI Protocol Definition: fcgi-spec.html                                    */
+/*                                                                             */
+/* Requests are multiplexed:                                                   */
+/*    - any number of requests may be active on the connection                 */
+/*    - each request is serviced as its records arrive, and the records        */
+/*      produced by its child are sent as soon as they are produced            */
+/*    - FCGI_GET_VALUES reports FCGI_MPXS_CONNS as "1"                         */
+/*    - a request beyond the limit on children ends with FCGI_OVERLOADED       */
+/*                                                                             */
+/* A connection may instead carry a single SCGI request, see "fcgi-scgi.c":   */
+/* its output is the content of the FCGI_STDOUT records, without headers.      */
+/*                                                                             */
+/* Zero-copy, when the descriptors allow it:                                  */
+/*    - the content of a FCGI_STDIN record that has not yet been received is   */
+/*      spliced from the connection directly into the pipe to the child        */
+/*    - the content of a FCGI_STDOUT record is spliced from the pipe of the    */
+/*      child directly to the connection; its header is sent with MSG_MORE     */
+/*                                                                             */
+/* The buffering is bounded in each direction:                                 */
+/*    - above OUTPUT_HIGH_WATER of unsent output, the stdout of the children   */
+/*      is no longer read, until the output drains to OUTPUT_LOW_WATER         */
+/*    - a FCGI_STDIN record for a child with STDIN_HIGH_WATER of unwritten     */
+/*      input stalls the connection, until the child reads its input           */
+/*                                                                             */
+/* Specifically,                                                               */
+/*    - Management records limited to FCGI_GET_VALUES                          */
+/*        o all other management records yield FCGI_UNKNOWN_TYPE               */
+/*    - Records for a requestId that is not active are ignored                 */
+/*    - A BEGIN_REQUEST with a role other than RESPONDER or AUTHORIZER is      */
+/*      answered with FCGI_UNKNOWN_ROLE                                        */
+/*    - ABORT_REQUEST ends the request at once, see responder_abort            */
+/*    - with config.abort_hangup, the end of the input, i.e., the Web server   */
+/*      has closed the connection, aborts the requests that are still active;  */
+/*      a stalled connection watches for it with EVENT_HANGUP                  */
+/*    - DATA, i.e., the FILTER role, is NOT supported                          */
+/*    - Any other deviation from the protocol closes the connection            */
+/*                                                                             */
+/*******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "fcgi-daemon.h"
+
+
+#define RECEIVE_SIZE   (FCGI_HEADER_LEN + FCGI_MAX_CONTENT_LEN + FCGI_MAX_PADDING_LEN)
+
+
+
+int connection_count = 0;
+int connection_retval = RETVAL_SUCCESS;
+
+
+/*******************************************************************************/
+/* Name-Value pairs                                                            */
+/*******************************************************************************/
+
+// Decode the Name-Value pair at *p, and advance *p past the pair.
+// RETVAL_PARTIAL: the pair continues beyond "end", e.g., in the next record
+int fcgi_decode_pair(const BYTE ** p, const BYTE * end,
+                     const BYTE ** name, int * name_length,
+                     const BYTE ** value, int * value_length) {
+  const BYTE * q = *p;
+
+  // Determine the correct FCGI_ NameVaulePair to use as our template.
+  // based upon the MSbit in q[0], and q[1] or q[4]
+  //
+  // Review the file "fcgi-spec.h" for additional information
+  return_error(end - q < 2, RETVAL_PARTIAL);
+
+  if ((q[0] >> 7) == 0) {
+    *name_length = q[0];
+    q += 1;
+  } else {
+    return_error(end - q < 5, RETVAL_PARTIAL);
+    *name_length = ((q[0] & 0x7f) << 24) + (q[1] << 16) + (q[2] << 8) + q[3];
+    q += 4;
+  }
+
+  if ((q[0] >> 7) == 0) {
+    *value_length = q[0];
+    q += 1;
+  } else {
+    return_error(end - q < 4, RETVAL_PARTIAL);
+    *value_length = ((q[0] & 0x7f) << 24) + (q[1] << 16) + (q[2] << 8) + q[3];
+    q += 4;
+  }
+
+  return_error(end - q < (long) *name_length + *value_length, RETVAL_PARTIAL);
+
+  *name = q;
+  *value = q + *name_length;
+  *p = *value + *value_length;
+
+  return RETVAL_SUCCESS;
+}
+
+
+// Append the Name-Value pair to the buffer
+int fcgi_encode_pair(fcgi_buffer * buffer, const char * name, int name_length,
+                     const char * value, int value_length) {
+  BYTE * q;
+
+  q = buffer_reserve(buffer, 8 + name_length + value_length);
+  return_error(q == NULL, RETVAL_MEMORY_ERR);
+
+  if (name_length < 0x80) {
+    *q++ = (BYTE) name_length;
+  } else {
+    *q++ = (BYTE) ((name_length >> 24) | 0x80);
+    *q++ = (BYTE) (name_length >> 16);
+    *q++ = (BYTE) (name_length >> 8);
+    *q++ = (BYTE) name_length;
+  }
+  if (value_length < 0x80) {
+    *q++ = (BYTE) value_length;
+  } else {
+    *q++ = (BYTE) ((value_length >> 24) | 0x80);
+    *q++ = (BYTE) (value_length >> 16);
+    *q++ = (BYTE) (value_length >> 8);
+    *q++ = (BYTE) value_length;
+  }
+  memcpy(q, name, name_length);   q += name_length;
+  memcpy(q, value, value_length); q += value_length;
+
+  buffer->end = q - buffer->data;
+  return RETVAL_SUCCESS;
+}
+
+
+
+/*******************************************************************************/
+/* The table of requests, indexed by requestId                                 */
+/*******************************************************************************/
+static fcgi_request * lookup_request(fcgi_connection * conn, int request_id) {
+  fcgi_request ** leaf = conn->requests[request_id >> 8];
+
+  return (leaf == NULL) ? NULL : leaf[request_id & 0xFF];
+}
+
+
+static int insert_request(fcgi_connection * conn, fcgi_request * request) {
+  fcgi_request *** leaf = &conn->requests[request->id >> 8];
+
+  if (*leaf == NULL) {
+    *leaf = (fcgi_request **) calloc(256, sizeof(fcgi_request *));
+    return_error(*leaf == NULL, RETVAL_MEMORY_ERR);
+  }
+  (*leaf)[request->id & 0xFF] = request;
+  conn->request_count ++;
+
+  return RETVAL_SUCCESS;
+}
+
+
+static void unsplice(fcgi_connection * conn, fcgi_request * request);
+
+
+static void remove_request(fcgi_connection * conn, fcgi_request * request) {
+  conn->requests[request->id >> 8][request->id & 0xFF] = NULL;
+  conn->request_count --;
+
+  // The content to be spliced is read before the pipe of the child is closed
+  if (conn->splice_request == request) unsplice(conn, request);
+
+  responder_release(request);
+  event_defer_free(request);
+}
+
+
+
+/*******************************************************************************/
+/* Connection life cycle                                                       */
+/*******************************************************************************/
+static void connection_handler(fcgi_event * event, int ready);
+static int  process_input(fcgi_connection * conn);
+static int  check_input_eof(fcgi_connection * conn);
+
+
+// The file type of the descriptor, or 0
+static int file_type(int fd) {
+  struct stat st;
+
+  return (fstat(fd, &st) == 0) ? (st.st_mode & S_IFMT) : 0;
+}
+
+
+fcgi_connection * connection_create(int in_fd, int out_fd, int protocol) {
+  fcgi_connection * conn;
+  int type;
+
+  conn = (fcgi_connection *) calloc(1, sizeof(fcgi_connection));
+  if (conn == NULL) return NULL;
+
+  conn->in_fd = in_fd;
+  conn->out_fd = out_fd;
+  conn->retval = RETVAL_CONN_CLOSED;     // until the first request arrives
+  conn->protocol = protocol;
+
+  fcntl(in_fd, F_SETFL, fcntl(in_fd, F_GETFL) | O_NONBLOCK);
+  fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL) | O_NONBLOCK);
+
+  // splice() moves data between a pipe, and a socket, a pipe or a file
+  type = file_type(in_fd);
+  conn->splice_in = (type == S_IFSOCK || type == S_IFIFO || type == S_IFREG);
+  type = file_type(out_fd);
+  conn->splice_out = (type == S_IFSOCK || type == S_IFIFO);
+  conn->out_socket = (type == S_IFSOCK);
+
+  // FCGI_STDIN need not wait for the rest of its record, see process_record
+  conn->parser.part_types = (1 << FCGI_STDIN);
+
+  if (event_add(&conn->in, in_fd, EVENT_READ, connection_handler, conn) != RETVAL_SUCCESS) {
+    free(conn);
+    return NULL;
+  }
+  if (out_fd != in_fd) {
+    event_add(&conn->out, out_fd, ZERO, connection_handler, conn);
+    event_edge(&conn->out);
+  } else {
+    conn->out.fd = -1;
+  }
+
+  // receive_input reads until EAGAIN, or a short read, and send_output writes
+  // until EAGAIN, unless they stop, and the mask changes
+  event_edge(&conn->in);
+
+  connection_count ++;
+  stats_count(STATS_CONNECTIONS, 1);
+  return conn;
+}
+
+
+static void connection_destroy(fcgi_connection * conn) {
+  int i, j;
+
+  if (conn->destroyed) return;
+  conn->destroyed = NONZERO;
+
+  for (i = 0; i < 256; i++) {
+    if (conn->requests[i] == NULL) continue;
+
+    for (j = 0; j < 256; j++) {
+      if (conn->requests[i][j] != NULL) remove_request(conn, conn->requests[i][j]);
+    }
+    free(conn->requests[i]);
+  }
+
+  event_remove(&conn->in);
+  event_remove(&conn->out);
+  close(conn->in_fd);
+  if (conn->out_fd != conn->in_fd) close(conn->out_fd);
+
+  buffer_free(&conn->input);
+  buffer_free(&conn->output);
+
+  connection_count --;
+  connection_retval = conn->retval;
+  event_defer_free(conn);
+}
+
+
+// Update the events of interest, and close the connection once it is done
+static void connection_update(fcgi_connection * conn) {
+  int read_mask;
+  int write_mask;
+
+  if (conn->destroyed) return;
+  if (conn->input_eof && ! conn->stalled && conn->request_count == 0) conn->closing = NONZERO;
+
+  if (conn->closing && buffer_length(&conn->output) == 0 && conn->splice_request == NULL) {
+    connection_destroy(conn);
+    return;
+  }
+
+  read_mask  = (conn->input_eof || conn->closing || conn->stalled) ? ZERO : EVENT_READ;
+  if (conn->stalled && ! conn->input_eof && ! conn->closing && config.abort_hangup) read_mask = EVENT_HANGUP;
+  write_mask = (buffer_length(&conn->output) != 0 || conn->splice_request != NULL) ? EVENT_WRITE : ZERO;
+
+  if (conn->out_fd == conn->in_fd) {
+    event_modify(&conn->in, read_mask | write_mask);
+  } else {
+    if (conn->in.fd >= 0) event_modify(&conn->in, read_mask);
+    event_modify(&conn->out, write_mask);
+  }
+}
+
+
+static void connection_fail(fcgi_connection * conn, int retval) {
+  conn->retval = retval;
+  connection_destroy(conn);
+}
+
+
+
+/*******************************************************************************/
+/* Accepting connections                                                       */
+/*    - the listener is the event, and its protocol, PROTOCOL_FCGI or          */
+/*      PROTOCOL_SCGI, is the int that its data points to                      */
+/*    - a TCP peer must be one of config.web_server_addrs, if any, as per      */
+/*      FCGI_WEB_SERVER_ADDRS                                                  */
+/*******************************************************************************/
+static int peer_allowed(const struct sockaddr_storage * peer) {
+  char address[INET6_ADDRSTRLEN];
+  const char * p;
+  size_t length;
+
+  if (config.web_server_addrs == NULL) return NONZERO;
+
+  if (peer->ss_family == AF_INET) {
+    inet_ntop(AF_INET, &((const struct sockaddr_in *) peer)->sin_addr, address, sizeof(address));
+  } else if (peer->ss_family == AF_INET6) {
+    const struct in6_addr * in6 = &((const struct sockaddr_in6 *) peer)->sin6_addr;
+
+    // An IPv4 peer of a dual-stack listener is listed as such
+    if (IN6_IS_ADDR_V4MAPPED(in6)) inet_ntop(AF_INET, &in6->s6_addr[12], address, sizeof(address));
+    else inet_ntop(AF_INET6, in6, address, sizeof(address));
+  } else {
+    return NONZERO;
+  }
+
+  // The list is separated by commas, possibly with spaces
+  length = strlen(address);
+  for (p = config.web_server_addrs; *p != '\0'; p += strcspn(p, ",")) {
+    p += strspn(p, ", ");
+    if (strncmp(p, address, length) == 0 && (p[length] == '\0' || p[length] == ',' || p[length] == ' ')) {
+      return NONZERO;
+    }
+  }
+  return ZERO;
+}
+
+
+// A connection from a listener, unless its peer is refused
+static void accepted(int conn_fd, struct sockaddr_storage * peer, int protocol) {
+  int one = 1;
+
+  if (! peer_allowed(peer)) {
+    close(conn_fd);
+    stats_count(STATS_REFUSED, 1);
+    return;
+  }
+
+  // The END_REQUEST, which follows the output, is not held back by Nagle
+  if (peer->ss_family == AF_INET || peer->ss_family == AF_INET6) {
+    setsockopt(conn_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  if (connection_create(conn_fd, conn_fd, protocol) == NULL) close(conn_fd);
+}
+
+
+void connection_accept(fcgi_event * event, int ready) {
+  struct sockaddr_storage peer;
+  socklen_t peer_length;
+  int protocol = *(int *) event->data;
+  int conn_fd;
+
+  // Already accepted by io_uring, see EVENT_ACCEPT
+  if (event->accepted >= 0) {
+    conn_fd = event->accepted;
+    event->accepted = -1;
+    peer_length = sizeof(peer);
+    if (getpeername(conn_fd, (struct sockaddr *) &peer, &peer_length) != 0 || peer_length == 0) peer.ss_family = AF_UNSPEC;
+    accepted(conn_fd, &peer, protocol);
+    return;
+  }
+
+  for (;;) {
+    peer_length = sizeof(peer);
+    conn_fd = accept4(event->fd, (struct sockaddr *) &peer, &peer_length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (conn_fd < 0) {
+      if (errno == EINTR) continue;
+      return;     // EAGAIN: the backlog is empty
+    }
+    if (peer_length == 0) peer.ss_family = AF_UNSPEC;
+    accepted(conn_fd, &peer, protocol);
+  }
+}
+
+
+
+/*******************************************************************************/
+/* Sending records                                                             */
+/*******************************************************************************/
+static void prepare_header(FCGI_Header * header, int type, int request_id,
+                           int content_length, int padding_length) {
+
+  header->version = FCGI_VERSION_1;
+  header->type = type;
+  header->requestIdB1 = (BYTE) ((request_id >> 8) & 0xFF);
+  header->requestIdB0 = (BYTE) (request_id & 0xFF);
+  header->contentLengthB1 = (BYTE) ((content_length >> 8) & 0xFF);
+  header->contentLengthB0 = (BYTE) (content_length & 0xFF);
+  header->paddingLength = padding_length;
+  header->reserved = ZERO;
+}
+
+
+// Records are padded to a multiple of eight bytes, as the specification recommends
+#define RECORD_ALIGN      (8)
+#define PADDING(length)   ((RECORD_ALIGN - ((length) % RECORD_ALIGN)) % RECORD_ALIGN)
+
+
+// Reserve space for a record with up to "content_length" bytes of content.
+// The content is placed at the returned pointer, and then committed.
+BYTE * connection_reserve_record(fcgi_connection * conn, int content_length) {
+  BYTE * p;
+
+  p = buffer_reserve(&conn->output, FCGI_HEADER_LEN + content_length + RECORD_ALIGN);
+  if (p == NULL) return NULL;
+  return (conn->protocol == PROTOCOL_SCGI) ? p : p + FCGI_HEADER_LEN;
+}
+
+
+int connection_commit_record(fcgi_connection * conn, int type, int request_id, int content_length) {
+  BYTE * p = conn->output.data + conn->output.end;
+  int padding_length = PADDING(content_length);
+
+  if (conn->protocol == PROTOCOL_SCGI) {
+    // The output is the content of FCGI_STDOUT, the other records are dropped
+    if (type == FCGI_STDOUT) buffer_commit(&conn->output, content_length);
+  } else {
+    prepare_header((FCGI_Header *) p, type, request_id, content_length, padding_length);
+    memset(p + FCGI_HEADER_LEN + content_length, ZERO, padding_length);
+    buffer_commit(&conn->output, FCGI_HEADER_LEN + content_length + padding_length);
+    stats_count(STATS_RECORDS_OUT, 1);
+  }
+
+  if (buffer_length(&conn->output) >= OUTPUT_HIGH_WATER && ! conn->output_full) {
+    conn->output_full = NONZERO;
+    conn->full_since = stats_now();
+  }
+
+  connection_update(conn);
+  return RETVAL_SUCCESS;
+}
+
+
+// Send a FCGI_STDOUT record whose content is spliced from the child of the
+// request, once the output that precedes it has been sent.  There is at most
+// one such record on a connection, i.e., conn->splice_request is NULL.
+int connection_splice_record(fcgi_connection * conn, fcgi_request * request, int content_length) {
+  int padding_length = PADDING(content_length);
+  BYTE * p;
+
+  p = buffer_reserve(&conn->output, FCGI_HEADER_LEN + padding_length);
+  return_error(p == NULL, RETVAL_MEMORY_ERR);
+
+  // The padding follows the spliced content; SCGI has neither header nor padding
+  if (conn->protocol == PROTOCOL_SCGI) {
+    padding_length = 0;
+  } else {
+    prepare_header((FCGI_Header *) p, FCGI_STDOUT, request->id, content_length, padding_length);
+    memset(p + FCGI_HEADER_LEN, ZERO, padding_length);
+    buffer_commit(&conn->output, FCGI_HEADER_LEN + padding_length);
+  }
+
+  conn->splice_request = request;
+  conn->splice_before = buffer_length(&conn->output) - padding_length;
+  conn->splice_remaining = content_length;
+  if (conn->protocol != PROTOCOL_SCGI) stats_count(STATS_RECORDS_OUT, 1);
+
+  connection_update(conn);
+  return RETVAL_SUCCESS;
+}
+
+
+// The request of the spliced record ends before its content has been sent:
+// the content, which is in the pipe of the child, is read into the output.
+static void unsplice(fcgi_connection * conn, fcgi_request * request) {
+  size_t length = conn->splice_remaining;
+  BYTE * p;
+  ssize_t count;
+
+  conn->splice_request = NULL;
+  if (length == 0) return;
+
+  if (buffer_reserve(&conn->output, length) == NULL) {
+    // The record can not be completed: the connection closes
+    buffer_consume(&conn->output, buffer_length(&conn->output));
+    conn->closing = NONZERO;
+    conn->retval = RETVAL_MEMORY_ERR;
+    return;
+  }
+
+  p = buffer_data(&conn->output) + conn->splice_before;
+  memmove(p + length, p, buffer_length(&conn->output) - conn->splice_before);
+  count = read(request->child_out.fd, p, length);
+  if (count < 0) count = 0;
+  memset(p + count, ZERO, length - count);
+  buffer_commit(&conn->output, length);
+}
+
+
+int connection_write_record(fcgi_connection * conn, int type, int request_id,
+                            const BYTE * content, int content_length) {
+  BYTE * p;
+
+  p = connection_reserve_record(conn, content_length);
+  return_error(p == NULL, RETVAL_MEMORY_ERR);
+
+  if (content_length != 0) memcpy(p, content, content_length);
+  return connection_commit_record(conn, type, request_id, content_length);
+}
+
+
+/*******************************************************************************/
+/*    - Send:    {FCGI_END_REQUEST, id, {status, protocolStatus}               */
+/*******************************************************************************/
+void connection_end_request(fcgi_request * request, int app_status, int protocol_status) {
+  fcgi_connection * conn = request->conn;
+  int request_id = request->id;
+  FCGI_EndRequestBody body;
+
+  body.appStatusB3 = (BYTE) ((app_status >> 24) & 0xFF);
+  body.appStatusB2 = (BYTE) ((app_status >> 16) & 0xFF);
+  body.appStatusB1 = (BYTE) ((app_status >>  8) & 0xFF);
+  body.appStatusB0 = (BYTE) (app_status & 0xFF);
+  body.protocolStatus = protocol_status;
+  body.reserved[0] = body.reserved[1] = body.reserved[2] = ZERO;
+
+  stats_since(STATS_REQUEST, request->began);
+  if (protocol_status == FCGI_REQUEST_COMPLETE) stats_count(STATS_COMPLETE, 1);
+  if (protocol_status == FCGI_OVERLOADED) stats_count(STATS_OVERLOADED, 1);
+  if (protocol_status == FCGI_UNKNOWN_ROLE) stats_count(STATS_UNKNOWN_ROLE, 1);
+
+  // SCGI has no protocolStatus: the request was not served by a child
+  if (conn->protocol == PROTOCOL_SCGI && protocol_status != FCGI_REQUEST_COMPLETE) {
+    static const char unavailable[] = "Status: 503 Service Unavailable\r\nContent-Type: text/plain\r\n\r\n";
+
+    connection_write_record(conn, FCGI_STDOUT, request_id, (const BYTE *) unavailable, sizeof(unavailable) - 1);
+  }
+
+  // After a request without FCGI_KEEP_CONN, once the others have ended too
+  remove_request(conn, request);
+  if (conn->last_request && conn->request_count == 0) conn->closing = NONZERO;
+
+  if (connection_write_record(conn, FCGI_END_REQUEST, request_id,
+                              (BYTE *) &body, sizeof(FCGI_EndRequestBody)) != RETVAL_SUCCESS) {
+    connection_fail(conn, RETVAL_MEMORY_ERR);
+    return;
+  }
+
+  // Resume the input that waited on this request
+  connection_resume(conn);
+}
+
+
+// Process the input that stalled, e.g., on a request that has since ended
+void connection_resume(fcgi_connection * conn) {
+  int retval;
+
+  if (! conn->stalled || conn->processing || conn->destroyed) return;
+
+  conn->stalled = ZERO;
+  retval = process_input(conn);
+  if (retval == RETVAL_SUCCESS && ! conn->destroyed) retval = check_input_eof(conn);
+  if (retval != RETVAL_SUCCESS) connection_fail(conn, retval);
+  else connection_update(conn);
+}
+
+
+static int send_output(fcgi_connection * conn) {
+  fcgi_request * request;
+  size_t length;
+  ssize_t count;
+
+  for (;;) {
+    request = conn->splice_request;
+
+    // The content of the spliced record follows the output before it
+    if (request != NULL && conn->splice_before == 0) {
+      if (conn->splice_remaining != 0) {
+        count = responder_splice_stdout(request, conn->out_fd, conn->splice_remaining,
+                                        buffer_length(&conn->output) != 0);
+        if (count < 0) {
+          if (errno == EINTR) continue;
+          if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+          return RETVAL_READ_WRITE_ERR;
+        }
+        return_error(count == 0, RETVAL_READ_WRITE_ERR);
+        conn->splice_remaining -= count;
+        stats_count(STATS_BYTES_OUT, count);
+        continue;
+      }
+      conn->splice_request = NULL;
+      if (! conn->output_full) responder_resume_output(request);
+      continue;
+    }
+
+    length = (request != NULL) ? conn->splice_before : buffer_length(&conn->output);
+    if (length == 0) break;
+
+    // MSG_MORE: the header of a spliced record is sent along with its content
+    if (conn->out_socket) {
+      count = send(conn->out_fd, buffer_data(&conn->output), length,
+                   MSG_NOSIGNAL | ((request != NULL) ? MSG_MORE : ZERO));
+    } else {
+      count = write(conn->out_fd, buffer_data(&conn->output), length);
+    }
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      return RETVAL_READ_WRITE_ERR;
+    }
+    buffer_consume(&conn->output, count);
+    if (request != NULL) conn->splice_before -= count;
+    stats_count(STATS_BYTES_OUT, count);
+  }
+
+  // Resume reading the stdout of the children
+  if (conn->output_full && buffer_length(&conn->output) <= OUTPUT_LOW_WATER) {
+    int i, j;
+
+    conn->output_full = ZERO;
+    stats_since(STATS_OUTPUT_BLOCKED, conn->full_since);
+    for (i = 0; i < 256; i++) {
+      if (conn->requests[i] == NULL) continue;
+      for (j = 0; j < 256; j++) {
+        if (conn->requests[i][j] != NULL) responder_resume_output(conn->requests[i][j]);
+      }
+    }
+  }
+  return RETVAL_SUCCESS;
+}
+
+
+
+/*******************************************************************************/
+/* Receiving records                                                           */
+/*******************************************************************************/
+
+// All the input of the request has been received: that of an AUTHORIZER
+// ends with its PARAMS, see authorizer_start
+static int input_complete(fcgi_request * request) {
+  return request->state == REQUEST_RUNNING || (request->state == REQUEST_STDIN && request->role == FCGI_AUTHORIZER);
+}
+
+
+// A new request on the connection, e.g., of a FCGI_BEGIN_REQUEST record
+int connection_add_request(fcgi_connection * conn, int request_id, int role, int keep_conn,
+                           fcgi_request ** result) {
+  fcgi_request * request;
+  int retval;
+
+  request = (fcgi_request *) calloc(1, sizeof(fcgi_request));
+  return_error(request == NULL, RETVAL_MEMORY_ERR);
+
+  request->conn = conn;
+  request->id = request_id;
+  request->role = role;
+  request->state = REQUEST_PARAMS;
+  request->began = stats_now();
+  request->pid = -1;
+  request->child_in.fd = -1;
+  request->child_out.fd = -1;
+  request->child_err.fd = -1;
+  request->spool_fd = -1;
+
+  request->keep_conn = keep_conn;
+  if (! request->keep_conn) conn->last_request = NONZERO;
+
+  retval = insert_request(conn, request);
+  if (retval != RETVAL_SUCCESS) {
+    free(request);
+    return retval;
+  }
+  conn->retval = RETVAL_SUCCESS;
+  stats_count(STATS_REQUESTS, 1);
+
+  *result = request;
+  return RETVAL_SUCCESS;
+}
+
+
+/*******************************************************************************/
+/*    - Receive: {FCGI_BEGIN_REQUEST, id, {role, flags} }                      */
+/*******************************************************************************/
+static int begin_request(fcgi_connection * conn, int request_id, const BYTE * content, int content_length) {
+  const FCGI_BeginRequestBody * body = (const FCGI_BeginRequestBody *) content;
+  fcgi_request * request;
+  int retval;
+
+  return_error(content_length != sizeof(FCGI_BeginRequestBody), RETVAL_PROTOCOL_ERROR);
+
+  // A requestId may be reused once its END_REQUEST is sent.  A pipelined
+  // request, e.g., replayed from a file, waits for the earlier one to end.
+  request = lookup_request(conn, request_id);
+  if (request != NULL) {
+    return_error(! input_complete(request), RETVAL_ID_MISMATCH);
+    return RETVAL_STALLED;
+  }
+
+  // The connection closes after a request without FCGI_KEEP_CONN
+  if (conn->last_request) return RETVAL_SUCCESS;
+  return_error(ZERO != (body->flags & ~FCGI_KEEP_CONN), RETVAL_PROTOCOL_ERROR);
+
+  // flags & FCGI_KEEP_CONN: If zero, the application closes the
+  // connection after responding to this request. If not zero, the
+  // application does not close the connection after responding to this
+  // request; the Web server retains responsibility for the connection.
+  retval = connection_add_request(conn, request_id, (body->roleB1 << 8) | body->roleB0,
+                                  (body->flags & FCGI_KEEP_CONN) ? NONZERO : ZERO, &request);
+  return_error(retval != RETVAL_SUCCESS, retval);
+
+  if (request->role != FCGI_RESPONDER && request->role != FCGI_AUTHORIZER) {
+    connection_end_request(request, ZERO, FCGI_UNKNOWN_ROLE);
+  }
+  return RETVAL_SUCCESS;
+}
+
+
+/*******************************************************************************/
+/*    - Receive: {FCGI_GET_VALUES, 0, <names> }                                */
+/*    - Send:    {FCGI_GET_VALUES_RESULT, 0, <values> }                        */
+/*                                                                             */
+/*  In addition to the variables of the specification, the current load is     */
+/*  reported for monitoring, see admit_child in "fcgi-responder.c"             */
+/*******************************************************************************/
+#define VALUES_CHILDREN_RUNNING  "CHILDREN_RUNNING"
+#define VALUES_CHILDREN_WAITING  "CHILDREN_WAITING"
+
+#define is_name(n)   (name_length == strlen(n) && memcmp(name, n, name_length) == 0)
+
+
+// The value of the variable, or NULL if it is not known
+static const char * get_value(const BYTE * name, int name_length, char * value) {
+  if (is_name(FCGI_MPXS_CONNS)) return "1";
+
+  if (is_name(FCGI_MAX_REQS) && config.max_children != 0) {
+    sprintf(value, "%d", config.max_children + config.max_waiting);
+    return value;
+  }
+  if (is_name(VALUES_CHILDREN_RUNNING)) {
+    sprintf(value, "%d", children_running);
+    return value;
+  }
+  if (is_name(VALUES_CHILDREN_WAITING)) {
+    sprintf(value, "%d", children_waiting);
+    return value;
+  }
+  return NULL;
+}
+
+
+static int get_values(fcgi_connection * conn, const BYTE * content, int content_length) {
+  fcgi_buffer result = { NULL, 0, 0, 0 };
+  const BYTE * p = content;
+  const BYTE * end = content + content_length;
+  const BYTE * name;  int name_length;
+  const BYTE * value; int value_length;
+  const char * result_value;
+  char number[16];
+  int retval = RETVAL_SUCCESS;
+
+  while (p < end && retval == RETVAL_SUCCESS) {
+    retval = fcgi_decode_pair(&p, end, &name, &name_length, &value, &value_length);
+    if (retval == RETVAL_PARTIAL) retval = RETVAL_PROTOCOL_ERROR;
+    if (retval != RETVAL_SUCCESS) break;
+
+    result_value = get_value(name, name_length, number);
+    if (result_value != NULL) {
+      retval = fcgi_encode_pair(&result, (const char *) name, name_length, result_value, strlen(result_value));
+    }
+  }
+
+  if (retval == RETVAL_SUCCESS && buffer_length(&result) <= FCGI_MAX_CONTENT_LEN) {
+    retval = connection_write_record(conn, FCGI_GET_VALUES_RESULT, FCGI_NULL_REQUEST_ID,
+                                     buffer_data(&result), buffer_length(&result));
+  }
+  buffer_free(&result);
+  return retval;
+}
+
+
+static int management_record(fcgi_connection * conn, int type, const BYTE * content, int content_length) {
+  FCGI_UnknownTypeBody body;
+
+  if (type == FCGI_GET_VALUES) return get_values(conn, content, content_length);
+
+  memset(&body, ZERO, sizeof(body));
+  body.type = type;
+  return connection_write_record(conn, FCGI_UNKNOWN_TYPE, FCGI_NULL_REQUEST_ID, (BYTE *) &body, sizeof(body));
+}
+
+
+static int process_record(fcgi_connection * conn, const fcgi_record * record) {
+  int request_id = record->request_id;
+  fcgi_request * request;
+
+  if (request_id == FCGI_NULL_REQUEST_ID) {
+    return management_record(conn, record->type, record->content, record->content_length);
+  }
+  if (record->type == FCGI_BEGIN_REQUEST) {
+    return begin_request(conn, request_id, record->content, record->content_length);
+  }
+
+  // Records of a request that is not active are ignored
+  request = lookup_request(conn, request_id);
+
+  switch (record->type) {
+
+  case FCGI_ABORT_REQUEST:
+    if (request == NULL) return RETVAL_SUCCESS;
+    return responder_abort(request);
+
+  case FCGI_PARAMS:
+    if (request == NULL) return RETVAL_SUCCESS;
+    return_error(request->state != REQUEST_PARAMS, RETVAL_PROTOCOL_ERROR);
+    return responder_params(request, record->content, record->content_length);
+
+  // The content of a FCGI_STDIN record is received in parts, see connection_create
+  case FCGI_STDIN:
+    if (request == NULL) return RETVAL_SUCCESS;
+    return_error(request->state != REQUEST_STDIN, RETVAL_PROTOCOL_ERROR);
+    return responder_stdin(request, record->content, record->content_length);
+
+  default:
+    return RETVAL_PROTOCOL_ERROR;
+  }
+}
+
+
+// Process each of the records, and parts of records, within the input buffer
+static int process_input(fcgi_connection * conn) {
+  fcgi_record record;
+  int retval = RETVAL_SUCCESS;
+
+  conn->processing = NONZERO;
+  while (! conn->closing && ! conn->destroyed) {
+    if (conn->protocol == PROTOCOL_SCGI) retval = scgi_next(conn, &record);
+    else retval = record_next(&conn->parser, &conn->input, &record);
+    if (retval == RETVAL_PARTIAL) {
+      retval = RETVAL_SUCCESS;
+      break;
+    }
+    if (retval != RETVAL_SUCCESS) break;
+
+    retval = process_record(conn, &record);
+    if (retval == RETVAL_STALLED) {
+      conn->stalled = NONZERO;
+      retval = RETVAL_SUCCESS;
+      break;
+    }
+    if (retval != RETVAL_SUCCESS || conn->destroyed) break;
+
+    record_done(&conn->parser, &conn->input);
+  }
+  conn->processing = ZERO;
+
+  return retval;
+}
+
+
+// At the end of the input, no request may still be waiting on its input
+static int check_input_eof(fcgi_connection * conn) {
+  int i, j;
+
+  // The Web server has closed the connection, i.e., it has abandoned its requests
+  if (conn->input_eof && config.abort_hangup && conn->request_count != 0) {
+    stats_count(STATS_ABORTED, conn->request_count);
+    return RETVAL_CONN_CLOSED;
+  }
+
+  if (conn->input_eof && ! conn->stalled && ! conn->closing) {
+    // A partial record, or a request still waiting on its input, can not complete
+    return_error(buffer_length(&conn->input) != 0, RETVAL_READ_WRITE_ERR);
+    return_error(conn->parser.state != RECORD_HEADER, RETVAL_READ_WRITE_ERR);
+
+    for (i = 0; i < 256; i++) {
+      if (conn->requests[i] == NULL) continue;
+      for (j = 0; j < 256; j++) {
+        fcgi_request * request = conn->requests[i][j];
+        return_error(request != NULL && ! input_complete(request), RETVAL_READ_WRITE_ERR);
+      }
+    }
+  }
+  return RETVAL_SUCCESS;
+}
+
+
+// Splice the rest of a FCGI_STDIN record into the pipe to the child.
+// Returns the count, or -1 and errno, as per splice()
+static ssize_t splice_input(fcgi_connection * conn) {
+  fcgi_request * request;
+
+  // Otherwise, the content is read and processed as usual
+  request = lookup_request(conn, conn->parser.request_id);
+  if (request == NULL || request->state != REQUEST_STDIN) {
+    errno = EINVAL;
+    return -1;
+  }
+  return responder_splice_stdin(request, conn->in_fd, conn->parser.remaining);
+}
+
+
+static int receive_input(fcgi_connection * conn) {
+  BYTE * p;
+  ssize_t count;
+  int retval;
+
+  for (;;) {
+    if (conn->splice_in && conn->parser.state == RECORD_CONTENT && buffer_length(&conn->input) == 0) {
+      count = splice_input(conn);
+      if (count > 0) {
+        stats_count(STATS_BYTES_IN, count);
+        record_skip(&conn->parser, &conn->input, count);
+
+        // The end of an SCGI body is not followed by more input
+        if (conn->parser.state != RECORD_CONTENT && conn->protocol == PROTOCOL_SCGI) {
+          retval = process_input(conn);
+          return_error(retval != RETVAL_SUCCESS, retval);
+          if (conn->closing || conn->destroyed) break;
+        }
+        continue;
+      }
+      if (count == 0) {
+        conn->input_eof = NONZERO;
+        break;
+      }
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) break;
+
+      // The pipe to the child is full, the child resumes the connection
+      if (errno == EBUSY) {
+        conn->stalled = NONZERO;
+        break;
+      }
+      // Otherwise, the content is read, e.g., to be discarded
+    }
+
+    p = buffer_reserve(&conn->input, RECEIVE_SIZE);
+    return_error(p == NULL, RETVAL_MEMORY_ERR);
+
+    count = read(conn->in_fd, p, RECEIVE_SIZE);
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      return RETVAL_READ_WRITE_ERR;
+    }
+    if (count == 0) {
+      conn->input_eof = NONZERO;
+      break;
+    }
+    buffer_commit(&conn->input, count);
+    stats_count(STATS_BYTES_IN, count);
+
+    retval = process_input(conn);
+    return_error(retval != RETVAL_SUCCESS, retval);
+    if (conn->closing || conn->destroyed || conn->stalled || (size_t) count < RECEIVE_SIZE) break;
+  }
+  if (conn->destroyed) return RETVAL_SUCCESS;
+
+  return check_input_eof(conn);
+}
+
+
+static void connection_handler(fcgi_event * event, int ready) {
+  fcgi_connection * conn = (fcgi_connection *) event->data;
+  int retval = RETVAL_SUCCESS;
+
+  if (ready & EVENT_READ) retval = receive_input(conn);
+  if (conn->destroyed) return;
+
+  // A stalled connection whose input has ended, see connection_update
+  if (ready & EVENT_HANGUP) {
+    conn->input_eof = NONZERO;
+    retval = check_input_eof(conn);
+  }
+  if (retval == RETVAL_SUCCESS && (ready & EVENT_WRITE)) retval = send_output(conn);
+
+  if (retval != RETVAL_SUCCESS) {
+    connection_fail(conn, retval);
+    return;
+  }
+  connection_update(conn);
+}
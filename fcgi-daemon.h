@@ -0,0 +1,565 @@
+/*****************************************************************************/
+/*  Declarations shared by the programs of the fcgi-daemon project:          */
+/*     - fcgi2env-exec: serves a single FCGI connection on stdin/stdout      */
+/*     - fcgi-launch:   a daemon that listens on ADDR:PORT                   */
+/*                                                                           */
+/*  Both programs are built from the same modules:                           */
+/*     - fcgi-event.c:       the event loop                                  */
+/*     - fcgi-buffer.c:      byte buffers                                    */
+/*     - fcgi-record.c:      the stream of FCGI records                      */
+/*     - fcgi-cache.c:       caches of responses                             */
+/*     - fcgi-stats.c:       counters and latency histograms                 */
+/*     - fcgi-connection.c:  FCGI records, and the requests of a connection  */
+/*     - fcgi-scgi.c:        SCGI requests, on the same connections          */
+/*     - fcgi-responder.c:   the RESPONDER and AUTHORIZER roles, i.e., the   */
+/*                           CGI child                                       */
+/*     - fcgi-pool.c:        persistent workers, instead of a child each     */
+/*     - fcgi-spawn.c:       posix_spawn(), or a zygote process              */
+/*     - fcgi-shard.c:       the processes of fcgi-launch -N, one per CPU    */
+/*     - fcgi-plugin.c:      handler plugins, instead of the CGI program     */
+/*****************************************************************************/
+
+#ifndef FCGI_DAEMON_H
+#define FCGI_DAEMON_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "fcgi-spec.h"
+#include "fcgi-plugin.h"
+
+
+// Implementation: Return Values
+#define RETVAL_SUCCESS        (0)
+#define RETVAL_PROTOCOL_ERROR (1)
+#define RETVAL_ID_MISMATCH    (2)
+#define RETVAL_UNABLE_TO_EXEC (3)
+#define RETVAL_READ_WRITE_ERR (4)
+#define RETVAL_MEMORY_ERR     (5)
+#define RETVAL_TOO_MANY_ENVS  (6)    // No longer returned: the environment is unbounded
+#define RETVAL_OTHER          (7)
+#define RETVAL_CONN_CLOSED    (8)    // The client closed the connection between requests
+
+#define RETVAL_STALLED        (-1)   // Internal: the record is processed again later
+#define RETVAL_PARTIAL        (-2)   // Internal: more input is needed
+
+
+#define BYTE unsigned char
+#define ZERO (0)
+#define NONZERO (!0)
+
+#define SELF  (0)
+
+#define exit_error(b,v)   if (b) exit(v);
+#define return_error(b,v) if (b) return (v);
+
+
+// The pump between a connection and its children is bounded in each direction
+#define OUTPUT_HIGH_WATER  (256 * 1024)   // Pause reading the stdout of the children
+#define OUTPUT_LOW_WATER   (64 * 1024)    // Resume reading the stdout of the children
+#define STDIN_HIGH_WATER   (256 * 1024)   // Pause reading the connection
+
+
+/*****************************************************************************/
+/*  Configuration, as provided on the command line                           */
+/*****************************************************************************/
+typedef struct {
+  char * program;               // The CGI program
+  int output_size;              // Coalesce the output of a child into records of this size
+  size_t max_params_bytes;      // The FCGI_PARAMS of a request, beyond which it ends, 0: no limit
+  int flush_delay;              // ... but send it after at most this many milliseconds
+  int max_children;             // The children that may run at the same time, 0: no limit
+  int max_waiting;              // The requests that may wait for a child
+  int wait_timeout;             // ... for at most this many milliseconds
+  size_t cache_size;            // The memory of the response cache, 0: no cache
+  int cache_ttl;                // The seconds a response is fresh, unless its headers say otherwise
+  char * cache_key;             // The PARAMS, separated by commas, that identify a response
+  char * stats_file;            // The statistics are written to this file, or NULL
+  int stats_interval;           // ... every this many milliseconds
+  char * stats_socket;          // The statistics are sent to each client of this Unix socket, or NULL
+  int pool_size;                // The persistent workers, see fcgi-pool.c, 0: a child per request
+  int pool_max_requests;        // A worker is replaced after this many requests, 0: no limit
+  int zygote;                   // The children are forked by a zygote process, see fcgi-spawn.c
+  size_t stderr_limit;          // The FCGI_STDERR of a request, beyond which it is dropped, 0: no limit
+  int stderr_drop;              // Drop the stderr of a child, rather than pause it, while the output is full
+  int request_timeout;          // The milliseconds a request may run, 0: no limit
+  int kill_grace;               // The milliseconds between SIGTERM and SIGKILL, see spawn_terminate
+  int abort_hangup;             // The end of a connection's input aborts its requests
+  size_t spool_memory;          // Spool the bodies, in memory up to this size, then in a file, 0: stream them
+  int io_uring;                 // The event loop waits for readiness via io_uring, rather than epoll, see fcgi-event.c
+  int shards;                   // The processes that accept the connections, see fcgi-shard.c, 0: one
+  int shard_affinity;           // ... each bound to a CPU of its own
+  char * web_server_addrs;      // The addresses the TCP connections may come from, or NULL: any
+  size_t auth_cache_size;       // The memory of the AUTHORIZER decision cache, 0: no cache
+  int auth_ttl;                 // The seconds a decision is fresh, unless its headers say otherwise
+  char * auth_key;              // The PARAMS, separated by commas, that identify a decision
+  int plugin;                   // The program is a handler plugin, see fcgi-plugin.c
+} fcgi_config;
+
+#define OUTPUT_SIZE    (8192)
+#define FLUSH_DELAY    (5)
+#define MAX_PARAMS     (1024 * 1024)
+#define MAX_WAITING    (100)
+#define WAIT_TIMEOUT   (1000)
+#define CACHE_TTL      (60)
+#define CACHE_KEY      "HTTP_HOST,SCRIPT_NAME,PATH_INFO,QUERY_STRING"
+#define AUTH_TTL       (10)
+#define AUTH_KEY       "HTTP_HOST,REQUEST_URI,HTTP_AUTHORIZATION,HTTP_COOKIE"
+#define STATS_INTERVAL (1000)
+#define STDERR_LIMIT   (64 * 1024)
+#define KILL_GRACE     (1000)
+
+#define CONFIG_DEFAULTS  { .program = NULL, .output_size = OUTPUT_SIZE, .flush_delay = FLUSH_DELAY, \
+                           .max_params_bytes = MAX_PARAMS, \
+                           .max_children = 0, .max_waiting = MAX_WAITING, .wait_timeout = WAIT_TIMEOUT, \
+                           .cache_size = 0, .cache_ttl = CACHE_TTL, .cache_key = CACHE_KEY, \
+                           .stats_file = NULL, .stats_interval = STATS_INTERVAL, .stats_socket = NULL, \
+                           .pool_size = 0, .pool_max_requests = 0, .zygote = 0, \
+                           .stderr_limit = STDERR_LIMIT, .stderr_drop = 0, \
+                           .request_timeout = 0, .kill_grace = KILL_GRACE, .abort_hangup = 0, \
+                           .spool_memory = 0, .io_uring = 0, .shards = 0, .shard_affinity = 0, \
+                           .web_server_addrs = NULL, \
+                           .auth_cache_size = 0, .auth_ttl = AUTH_TTL, .auth_key = AUTH_KEY, \
+                           .plugin = 0 }
+
+extern fcgi_config config;
+
+
+/*****************************************************************************/
+/*  fcgi-buffer.c                                                            */
+/*****************************************************************************/
+typedef struct {
+  BYTE * data;
+  size_t start;                 // data[start .. end) has not been consumed
+  size_t end;
+  size_t size;
+} fcgi_buffer;
+
+#define buffer_data(b)          ((b)->data + (b)->start)
+#define buffer_length(b)        ((b)->end - (b)->start)
+#define buffer_commit(b,n)      ((b)->end += (n))
+
+BYTE * buffer_reserve(fcgi_buffer * buffer, size_t count);
+int    buffer_append(fcgi_buffer * buffer, const void * data, size_t count);
+void   buffer_consume(fcgi_buffer * buffer, size_t count);
+void   buffer_free(fcgi_buffer * buffer);
+
+
+/*****************************************************************************/
+/*  fcgi-event.c                                                             */
+/*****************************************************************************/
+#define EVENT_READ   (1 << 0)
+#define EVENT_WRITE  (1 << 1)
+#define EVENT_HANGUP (1 << 2)    // The peer has shut down its side, i.e., EPOLLRDHUP
+#define EVENT_ACCEPT (1 << 3)    // A listener: io_uring accepts its connections, see event->accepted
+
+typedef struct fcgi_event fcgi_event;
+typedef void (* fcgi_event_handler)(fcgi_event * event, int ready);
+
+struct fcgi_event {
+  int fd;                       // -1 once the event has been removed
+  int mask;                     // EVENT_READ and/or EVENT_WRITE, or EVENT_HANGUP
+  int registered;               // the fd is in the epoll set, or the mask of its io_uring poll
+  int always_ready;             // the fd can not be polled, e.g., a regular file
+  fcgi_event_handler handler;
+  void * data;
+  fcgi_event * next_ready;
+  struct event_poll * poll;     // io_uring: the pending poll, see fcgi-event.c
+  int changed;                  // ... the event is on the list of changes
+  int edge;                     // ... the handler drains the fd, see event_edge
+  int accepted;                 // ... the connection accepted for EVENT_ACCEPT, or -1
+};
+
+int  event_init(void);
+int  event_add(fcgi_event * event, int fd, int mask, fcgi_event_handler handler, void * data);
+int  event_modify(fcgi_event * event, int mask);
+void event_remove(fcgi_event * event);
+void event_edge(fcgi_event * event);
+void event_defer_free(void * memory);
+int  event_dispatch(int timeout);
+
+// Timers, in milliseconds of the monotonic clock
+typedef struct fcgi_timer fcgi_timer;
+typedef void (* fcgi_timer_handler)(fcgi_timer * timer);
+
+struct fcgi_timer {
+  long long deadline;
+  int active;
+  fcgi_timer_handler handler;
+  void * data;
+  fcgi_timer * next;            // The active timers, by deadline
+};
+
+long long event_now(void);
+void timer_start(fcgi_timer * timer, int delay, fcgi_timer_handler handler, void * data);
+void timer_stop(fcgi_timer * timer);
+
+
+/*****************************************************************************/
+/*  fcgi-record.c                                                            */
+/*****************************************************************************/
+#define RECORD_HEADER    (0)    // Waiting on the header of a record
+#define RECORD_CONTENT   (1)    // Within the content of a record returned in parts
+#define RECORD_PADDING   (2)    // Within the padding of a record returned in parts
+
+typedef struct {
+  int type;
+  int request_id;
+  const BYTE * content;         // Within the input buffer
+  size_t content_length;
+  int part;                     // The content is a part of the record's content
+} fcgi_record;
+
+typedef struct {
+  int state;
+  int part_types;               // The types of records returned in parts, (1 << type)
+  int type;                     // The record returned in parts
+  int request_id;
+  size_t remaining;             // The content not yet returned
+  size_t padding;               // The padding not yet skipped
+  size_t consume;               // The input consumed by record_done
+} fcgi_record_parser;
+
+int  record_next(fcgi_record_parser * parser, fcgi_buffer * input, fcgi_record * record);
+void record_done(fcgi_record_parser * parser, fcgi_buffer * input);
+void record_skip(fcgi_record_parser * parser, fcgi_buffer * input, size_t count);
+
+
+/*****************************************************************************/
+/*  fcgi-cache.c                                                             */
+/*****************************************************************************/
+typedef struct fcgi_cache_entry fcgi_cache_entry;
+
+struct fcgi_cache_entry {
+  fcgi_cache_entry * next;      // The entries of the same bucket
+  fcgi_cache_entry * newer;     // The least recently used list
+  fcgi_cache_entry * older;
+  unsigned hash;
+  long long expires;            // See event_now
+  int status;                   // The appStatus of the response
+  size_t key_length;
+  size_t data_length;
+  BYTE data[];                  // The key, followed by the data
+};
+
+#define cache_entry_data(e)     ((e)->data + (e)->key_length)
+
+typedef struct {
+  size_t budget;                // The memory available to the entries
+  size_t size;                  // The memory of the entries
+  size_t count;
+  fcgi_cache_entry ** buckets;
+  size_t bucket_count;          // A power of 2
+  fcgi_cache_entry * newest;
+  fcgi_cache_entry * oldest;
+  long long hits;
+  long long misses;
+  long long evictions;
+} fcgi_cache;
+
+void cache_init(fcgi_cache * cache, size_t budget);
+fcgi_cache_entry * cache_lookup(fcgi_cache * cache, const BYTE * key, size_t key_length);
+fcgi_cache_entry * cache_insert(fcgi_cache * cache, const BYTE * key, size_t key_length,
+                                const BYTE * data, size_t data_length, int status, long long ttl);
+long long cache_response_ttl(const BYTE * response, size_t length, long long ttl);
+
+
+/*****************************************************************************/
+/*  fcgi-stats.c                                                             */
+/*****************************************************************************/
+#define STATS_CONNECTIONS       (0)     // Counters
+#define STATS_REQUESTS          (1)
+#define STATS_RECORDS_IN        (2)
+#define STATS_RECORDS_OUT       (3)
+#define STATS_BYTES_IN          (4)     // Of the connections
+#define STATS_BYTES_OUT         (5)
+#define STATS_STDIN_BYTES       (6)     // Of the children
+#define STATS_STDOUT_BYTES      (7)
+#define STATS_SPAWNS            (8)
+#define STATS_SPAWN_ERRORS      (9)
+#define STATS_COMPLETE          (10)    // The protocolStatus of the END_REQUEST records
+#define STATS_OVERLOADED        (11)
+#define STATS_UNKNOWN_ROLE      (12)
+#define STATS_CACHE_HITS        (13)
+#define STATS_CACHE_MISSES      (14)
+#define STATS_STDERR_BYTES      (15)    // Sent as FCGI_STDERR
+#define STATS_STDERR_DROPPED    (16)    // ... or dropped, see config.stderr_limit
+#define STATS_ABORTED           (17)    // Requests ended by FCGI_ABORT_REQUEST, or a hangup
+#define STATS_TIMED_OUT         (18)    // ... by config.request_timeout
+#define STATS_TERMINATED        (19)    // Children sent SIGTERM, see spawn_terminate
+#define STATS_KILLED            (20)    // ... and then SIGKILL
+#define STATS_SPOOL_BYTES       (21)    // Request bodies spooled, see config.spool_memory
+#define STATS_SPOOL_FILES       (22)    // ... to a temporary file
+#define STATS_BAD_LENGTH        (23)    // ... that did not match their CONTENT_LENGTH
+#define STATS_EVENT_SYSCALLS    (24)    // Of the event loop: its waits, and its epoll_ctl calls
+#define STATS_EVENT_CHANGES     (25)    // ... the changes of its events, see fcgi-event.c
+#define STATS_REFUSED           (26)    // Connections not from config.web_server_addrs
+#define STATS_AUTH_ALLOWED      (27)    // The decisions of the AUTHORIZER, see fcgi-responder.c
+#define STATS_AUTH_DENIED       (28)
+#define STATS_AUTH_HITS         (29)    // ... replayed from the decision cache
+#define STATS_AUTH_MISSES       (30)
+#define STATS_PLUGIN_CALLS      (31)    // Requests served by a handler plugin, see fcgi-plugin.c
+#define STATS_COUNTERS          (32)
+
+#define STATS_PARAMS            (0)     // Histograms: BEGIN_REQUEST to the end of PARAMS
+#define STATS_WAIT              (1)     // ... waiting for a child, see admit_child
+#define STATS_SPAWN             (2)     // ... spawn_program()
+#define STATS_FIRST_OUTPUT      (3)     // ... the spawn to the first output of the child
+#define STATS_STDIN             (4)     // ... the end of PARAMS to the end of STDIN
+#define STATS_STDOUT            (5)     // ... the spawn to the end of the child's output
+#define STATS_EXIT              (6)     // ... the spawn to the exit of the child
+#define STATS_REQUEST           (7)     // ... BEGIN_REQUEST to END_REQUEST
+#define STATS_OUTPUT_BLOCKED    (8)     // ... a connection above OUTPUT_HIGH_WATER
+#define STATS_HISTOGRAMS        (9)
+
+#define STATS_CONNECTIONS_OPEN  (0)     // Gauges, see stats_gauges
+#define STATS_CHILDREN_RUNNING  (1)
+#define STATS_CHILDREN_WAITING  (2)
+#define STATS_RSS_KB            (3)
+#define STATS_GAUGES            (4)
+
+#define HISTOGRAM_SUB_BITS      (5)
+#define HISTOGRAM_SUB           (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS       (HISTOGRAM_SUB * 36)    // Up to 2^40 microseconds
+
+typedef struct {
+  long long count;
+  long long sum;
+  long long min;
+  long long max;
+  long long buckets[HISTOGRAM_BUCKETS];
+} fcgi_histogram;
+
+typedef struct {
+  long long counters[STATS_COUNTERS];
+  fcgi_histogram histograms[STATS_HISTOGRAMS];
+  long long gauges[STATS_GAUGES];
+} fcgi_stats;
+
+extern fcgi_stats * stats;      // Of this process, or of its shard, see fcgi-shard.c
+
+#define stats_count(c,n)        (stats->counters[c] += (n))
+
+int  stats_init(void);
+long long stats_now(void);
+void stats_record(int histogram, long long value);
+void stats_since(int histogram, long long start);
+void stats_merge(fcgi_stats * to, const fcgi_stats * from);
+void stats_gauges(fcgi_stats * s);
+void stats_rollup(fcgi_stats * shards, int count);
+int  stats_report(fcgi_buffer * report, const fcgi_stats * s);
+
+
+/*****************************************************************************/
+/*  fcgi-connection.c                                                        */
+/*****************************************************************************/
+typedef struct fcgi_connection fcgi_connection;
+typedef struct fcgi_request fcgi_request;
+typedef struct fcgi_worker fcgi_worker;
+
+// The protocol of a connection
+#define PROTOCOL_FCGI    (0)
+#define PROTOCOL_SCGI    (1)
+
+// The state of an SCGI connection, see fcgi-scgi.c
+#define SCGI_HEADERS     (0)    // Receiving the netstring of headers
+#define SCGI_BODY        (1)    // Receiving the body, as FCGI_STDIN
+#define SCGI_END         (2)    // The body has been received
+#define SCGI_DONE        (3)
+
+// The state of a request, in the order of the communication flow
+#define REQUEST_PARAMS   (0)    // Receiving FCGI_PARAMS
+#define REQUEST_STDIN    (1)    // Receiving FCGI_STDIN
+#define REQUEST_RUNNING  (2)    // All input received, waiting on the child
+
+struct fcgi_request {
+  fcgi_connection * conn;
+  int id;                       // The 16-bit requestId
+  int role;
+  int keep_conn;
+  int state;
+  long long began;              // The phases of the request, see stats_now
+  long long params_ended;
+
+  // The RESPONDER, or AUTHORIZER: see fcgi-responder.c
+  fcgi_buffer env;              // The CGI environment, see fcgi-responder.c
+  int env_count;
+  fcgi_buffer params;           // The start of a Name-Value pair that spans records
+  size_t params_length;         // The content of the FCGI_PARAMS records, see config.max_params_bytes
+
+  pid_t pid;                    // The child process, 0 while it is spawned, or -1
+  fcgi_worker * worker;         // ... or the worker that serves the request, see fcgi-pool.c
+  long long spawned;            // See stats_now
+  int output_seen;              // The child's output has been timed, see STATS_FIRST_OUTPUT
+  int status;                   // The exit status of the child
+  fcgi_event child_in;          // The pipe to the child's stdin, fd -1 once closed
+  fcgi_event child_out;         // The pipe from the child's stdout, fd -1 once closed
+  fcgi_event child_err;         // The pipe from the child's stderr, fd -1 once closed
+  size_t stderr_sent;           // The content of the FCGI_STDERR records
+  fcgi_buffer stdin_queue;      // FCGI_STDIN data not yet written to the child
+  int spool_fd;                 // ... or the whole body, see config.spool_memory, -1 if none
+  int spool_file;               // ... which is a temporary file, rather than a memfd
+  size_t spool_length;
+  long long content_length;     // CONTENT_LENGTH, or -1 if there is none
+  int stdin_eof;                // The empty FCGI_STDIN record was received
+  fcgi_buffer stdout_pending;   // Output of the child, coalesced into a FCGI_STDOUT record
+  fcgi_timer flush_timer;       // Sends the pending output, see config.flush_delay
+  int stdout_eof;               // The child closed its stdout
+  int exited;                   // The child has been reaped
+  fcgi_timer timeout_timer;     // See config.request_timeout
+
+  int caching;                  // The response is captured for the cache
+  fcgi_buffer cache_key;
+  fcgi_buffer cache_data;       // The FCGI_STDOUT sent so far, or held
+  int authorizing;              // The output is held until it ends, see authorizer_respond
+
+  int waiting;                  // The request waits for a child, see admit_child
+  fcgi_timer wait_timer;
+
+  fcgi_request * next_child;    // The list of requests with a running child, or waiting for one
+  fcgi_request * prev_child;
+};
+
+struct fcgi_connection {
+  int in_fd;
+  int out_fd;                   // The same as in_fd for a socket
+  fcgi_event in;                // Also used for writes, if in_fd == out_fd
+  fcgi_event out;
+
+  fcgi_buffer input;            // Records that have not yet been processed
+  fcgi_buffer output;           // Records that have not yet been sent
+  fcgi_record_parser parser;    // The records within the input
+  int protocol;                 // PROTOCOL_FCGI or PROTOCOL_SCGI
+  int scgi_state;
+
+  // Zero-copy: the content of a FCGI_STDOUT record is spliced from the child
+  int splice_in;                // in_fd supports splice()
+  int splice_out;               // out_fd supports splice()
+  int out_socket;               // out_fd is a socket, i.e., supports MSG_MORE
+  fcgi_request * splice_request;  // The request whose content is spliced, or NULL
+  size_t splice_before;         // The output that precedes the content
+  size_t splice_remaining;      // The content not yet spliced
+
+  fcgi_request ** requests[256];  // Indexed by the high, then the low byte of the requestId
+  int request_count;
+
+  int input_eof;
+  int last_request;             // A request without FCGI_KEEP_CONN has begun
+  int stalled;                  // The next record waits, e.g., on a request to end
+  int output_full;              // The output is above OUTPUT_HIGH_WATER
+  long long full_since;         // See stats_now
+  int processing;               // Within process_input
+  int closing;                  // Close the connection once the output is sent
+  int destroyed;                // The memory is released after the event dispatch
+  int retval;                   // The first error on the connection
+};
+
+extern int connection_count;    // The number of open connections
+extern int connection_retval;   // The retval of the most recently closed connection
+
+int fcgi_decode_pair(const BYTE ** p, const BYTE * end,
+                     const BYTE ** name, int * name_length,
+                     const BYTE ** value, int * value_length);
+int fcgi_encode_pair(fcgi_buffer * buffer, const char * name, int name_length,
+                     const char * value, int value_length);
+
+fcgi_connection * connection_create(int in_fd, int out_fd, int protocol);
+void connection_accept(fcgi_event * listener, int ready);
+int  connection_add_request(fcgi_connection * conn, int request_id, int role, int keep_conn,
+                            fcgi_request ** result);
+int  connection_write_record(fcgi_connection * conn, int type, int request_id,
+                             const BYTE * content, int content_length);
+BYTE * connection_reserve_record(fcgi_connection * conn, int content_length);
+int  connection_commit_record(fcgi_connection * conn, int type, int request_id, int content_length);
+int  connection_splice_record(fcgi_connection * conn, fcgi_request * request, int content_length);
+void connection_end_request(fcgi_request * request, int app_status, int protocol_status);
+void connection_resume(fcgi_connection * conn);
+
+
+/*****************************************************************************/
+/*  fcgi-scgi.c                                                              */
+/*****************************************************************************/
+int  scgi_next(fcgi_connection * conn, fcgi_record * record);
+
+
+/*****************************************************************************/
+/*  fcgi-responder.c                                                         */
+/*****************************************************************************/
+extern int children_running;    // The children that have not yet been reaped
+extern int children_waiting;    // The requests waiting for a child
+
+int  responder_init(void);
+void responder_admit(void);
+void responder_exited(pid_t pid, int status);
+int  responder_params(fcgi_request * request, const BYTE * content, int content_length);
+int  responder_env(fcgi_request * request, const BYTE * name, int name_length,
+                   const BYTE * value, int value_length);
+int  responder_stdin(fcgi_request * request, const BYTE * content, int content_length);
+void responder_release(fcgi_request * request);
+int  responder_abort(fcgi_request * request);
+void responder_resume_output(fcgi_request * request);
+ssize_t responder_splice_stdin(fcgi_request * request, int fd, size_t length);
+ssize_t responder_splice_stdout(fcgi_request * request, int fd, size_t length, int more);
+
+
+/*****************************************************************************/
+/*  fcgi-pool.c                                                              */
+/*****************************************************************************/
+struct fcgi_worker {
+  pid_t pid;                    // -1 once the worker has exited
+  int to_worker;                // The pipe to its stdin, -1 if the slot is empty
+  int from_worker;              // The pipe from its stdout
+  int requests;                 // The requests served
+  int broken;                   // The worker is replaced, rather than reused
+  fcgi_request * request;       // The request being served, or NULL if idle
+  fcgi_worker * next_idle;
+
+  // The response, see pool_read
+  int state;
+  size_t remaining;             // The content of the chunk not yet read
+  char line[32];                // The length of the chunk, as read so far
+  int line_length;
+  int ended;                    // The end of the response has been read
+  int status;                   // ... and its exit status
+};
+
+int  pool_init(void);
+int  pool_reaped(pid_t pid);
+int  pool_idle(void);
+fcgi_worker * pool_acquire(fcgi_request * request);
+void pool_release(fcgi_worker * worker);
+int  pool_frame(fcgi_buffer * buffer, const void * data, size_t length);
+ssize_t pool_read(fcgi_worker * worker, fcgi_buffer * output, size_t size);
+
+
+/*****************************************************************************/
+/*  fcgi-spawn.c                                                             */
+/*****************************************************************************/
+typedef void (* fcgi_spawn_handler)(void * data, pid_t pid, int error);
+
+int   spawn_init(void);
+pid_t spawn_program(char ** env, int stdin_fd, int stdout_fd, int stderr_fd,
+                    fcgi_spawn_handler handler, void * data);
+void  spawn_cancel(void * data);
+int   spawn_reaped(pid_t pid);
+void  spawn_terminate(pid_t pid);
+void  spawn_exited(pid_t pid);
+
+
+/*****************************************************************************/
+/*  fcgi-shard.c                                                             */
+/*****************************************************************************/
+int shard_cpus(void);
+int shard_start(void);
+
+
+/*****************************************************************************/
+/*  fcgi-plugin.c                                                            */
+/*****************************************************************************/
+int   plugin_load(const char * path);
+int   plugin_init(void);
+int   plugin_handle(char ** params, fcgi_plugin_io * io);
+pid_t plugin_fork(int stdin_fd, int stdout_fd);
+
+
+#endif
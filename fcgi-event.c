@@ -0,0 +1,668 @@
+/*******************************************************************************/
+/*  The event loop                                                             */
+/*     - each file descriptor of interest is registered as an fcgi_event       */
+/*     - the mask of an event selects EVENT_READ and/or EVENT_WRITE            */
+/*     - event_dispatch waits via epoll, or io_uring, see config.io_uring,     */
+/*       and calls the handler of each ready event with the subset of its      */
+/*       mask that is ready                                                    */
+/*                                                                             */
+/*  Notes:                                                                     */
+/*    - An event with an empty mask is removed from the epoll set, otherwise   */
+/*      a hangup on the descriptor would be reported over and over.            */
+/*    - epoll cannot wait on a regular file, e.g., "fcgi2env-exec < file".     */
+/*      Such an event is always ready.                                         */
+/*    - A handler may release the memory of other events, e.g., when a        */
+/*      connection is destroyed.  Such memory is handed to event_defer_free,   */
+/*      and is freed once all of the ready events have been dispatched.        */
+/*    - Timers expire after the ready events are dispatched.  A timer is       */
+/*      stopped before the memory that holds it is released.                  */
+/*                                                                             */
+/*******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <endian.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "fcgi-daemon.h"
+
+
+#define MAX_EVENTS (256)
+
+#define URING_ENTRIES     (256)         // The submission queue, which is flushed once full
+#define URING_COMPLETIONS (4096)        // The completion queue: the kernel keeps any overflow
+
+
+static int epoll_fd = -1;
+static int uring_fd = -1;
+
+static fcgi_event * always_ready = NULL;   // events that epoll can not wait on
+
+static void ** deferred = NULL;            // memory to be freed after dispatch
+static int deferred_count = 0;
+static int deferred_size = 0;
+
+static fcgi_timer * timers = NULL;         // the active timers, by deadline
+
+
+static int uring_init(void);
+static int uring_modify(fcgi_event * event);
+static void uring_remove(fcgi_event * event);
+static int uring_dispatch(int timeout);
+
+
+// Without io_uring, e.g., as disabled by the kernel, the event loop uses epoll
+int event_init(void) {
+  if (config.io_uring && uring_init() == RETVAL_SUCCESS) return RETVAL_SUCCESS;
+  config.io_uring = ZERO;
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  return_error(epoll_fd < 0, RETVAL_OTHER);
+
+  return RETVAL_SUCCESS;
+}
+
+
+// The events of an fcgi_event mask, as epoll and poll(2) share them
+static int epoll_mask(int mask) {
+  int events = 0;
+
+  if (mask & EVENT_READ)  events |= EPOLLIN | EPOLLRDHUP;
+  if (mask & EVENT_WRITE) events |= EPOLLOUT;
+  if (mask & EVENT_HANGUP) events |= EPOLLRDHUP;
+  return events;
+}
+
+
+// ... and the other way around
+static int ready_mask(unsigned events) {
+  int ready = 0;
+
+  if (events & (EPOLLIN | EPOLLRDHUP))  ready |= EVENT_READ;
+  if (events & EPOLLOUT)                ready |= EVENT_WRITE;
+  if (events & (EPOLLHUP | EPOLLERR))   ready |= EVENT_READ | EVENT_WRITE;
+  if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) ready |= EVENT_HANGUP;
+  return ready;
+}
+
+
+static int epoll_change(int op, int fd, struct epoll_event * ev) {
+  stats_count(STATS_EVENT_SYSCALLS, 1);
+  stats_count(STATS_EVENT_CHANGES, 1);
+  return epoll_ctl(epoll_fd, op, fd, ev);
+}
+
+
+int event_add(fcgi_event * event, int fd, int mask, fcgi_event_handler handler, void * data) {
+  event->fd = fd;
+  event->mask = ZERO;
+  event->registered = ZERO;
+  event->always_ready = ZERO;
+  event->handler = handler;
+  event->data = data;
+  event->next_ready = NULL;
+  event->poll = NULL;
+  event->changed = ZERO;
+  event->edge = ZERO;
+  event->accepted = -1;
+
+  return event_modify(event, mask);
+}
+
+
+// The handler reads, or writes, until EAGAIN, unless it changes the mask: the
+// event need not be level-triggered, and io_uring polls it with a multishot poll
+void event_edge(fcgi_event * event) {
+  event->edge = NONZERO;
+}
+
+
+int event_modify(fcgi_event * event, int mask) {
+  struct epoll_event ev;
+
+  return_error(event->fd < 0, RETVAL_OTHER);
+
+  // The edge of a bit that the mask has dropped, e.g., while a connection is
+  // stalled, is not reported again: the multishot poll is armed anew
+  if (uring_fd >= 0 && event->edge && (mask & ~event->mask)) event->registered = ZERO;
+
+  event->mask = mask;
+  if (event->always_ready) return RETVAL_SUCCESS;
+  if (uring_fd >= 0) return uring_modify(event);
+
+  if (mask == ZERO) {
+    if (event->registered) epoll_change(EPOLL_CTL_DEL, event->fd, NULL);
+    event->registered = ZERO;
+    return RETVAL_SUCCESS;
+  }
+
+  ev.events = epoll_mask(mask);
+  ev.data.ptr = event;
+
+  if (epoll_change(event->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, event->fd, &ev) == 0) {
+    event->registered = NONZERO;
+    return RETVAL_SUCCESS;
+  }
+
+  // The descriptor can not be polled, it is always ready for I/O
+  return_error(errno != EPERM, RETVAL_OTHER);
+  event->always_ready = NONZERO;
+  event->next_ready = always_ready;
+  always_ready = event;
+
+  return RETVAL_SUCCESS;
+}
+
+
+void event_remove(fcgi_event * event) {
+  fcgi_event ** p;
+
+  if (event->fd < 0) return;
+
+  if (event->always_ready) {
+    for (p = &always_ready; *p != NULL; p = &(*p)->next_ready) {
+      if (*p == event) { *p = event->next_ready; break; }
+    }
+  } else if (uring_fd >= 0) {
+    uring_remove(event);
+  } else if (event->registered) {
+    epoll_change(EPOLL_CTL_DEL, event->fd, NULL);
+  }
+  event->fd = -1;
+  event->mask = ZERO;
+  event->registered = ZERO;
+  event->always_ready = ZERO;
+}
+
+
+void event_defer_free(void * memory) {
+  if (deferred_count == deferred_size) {
+    int size = (deferred_size == 0) ? 16 : deferred_size * 2;
+    void ** p = (void **) realloc(deferred, size * sizeof(void *));
+
+    if (p == NULL) return;      // leak, rather than risk a use after free
+    deferred = p;
+    deferred_size = size;
+  }
+  deferred[deferred_count++] = memory;
+}
+
+
+/*******************************************************************************/
+/* Timers                                                                      */
+/*******************************************************************************/
+long long event_now(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+void timer_start(fcgi_timer * timer, int delay, fcgi_timer_handler handler, void * data) {
+  fcgi_timer ** p;
+
+  timer_stop(timer);
+  timer->deadline = event_now() + delay;
+  timer->handler = handler;
+  timer->data = data;
+  timer->active = NONZERO;
+
+  for (p = &timers; *p != NULL && (*p)->deadline <= timer->deadline; p = &(*p)->next) ;
+  timer->next = *p;
+  *p = timer;
+}
+
+
+void timer_stop(fcgi_timer * timer) {
+  fcgi_timer ** p;
+
+  if (! timer->active) return;
+  for (p = &timers; *p != NULL; p = &(*p)->next) {
+    if (*p == timer) { *p = timer->next; break; }
+  }
+  timer->active = ZERO;
+}
+
+
+// The timeout for epoll_wait, given the next deadline
+static int timer_timeout(int timeout) {
+  long long delay;
+
+  if (timers == NULL) return timeout;
+
+  delay = timers->deadline - event_now();
+  if (delay < 0) delay = 0;
+  return (timeout < 0 || delay < timeout) ? (int) delay : timeout;
+}
+
+
+static void expire_timers(void) {
+  fcgi_timer * timer;
+  long long now = event_now();
+
+  while (timers != NULL && timers->deadline <= now) {
+    timer = timers;
+    timers = timer->next;
+    timer->active = ZERO;
+    timer->handler(timer);
+  }
+}
+
+
+
+static void call_handler(fcgi_event * event, int ready) {
+  // The event might have been removed by an earlier handler
+  if (event->fd < 0) return;
+
+  ready &= event->mask;
+  if (ready != ZERO) event->handler(event, ready);
+}
+
+
+static int epoll_dispatch(int timeout) {
+  struct epoll_event events[MAX_EVENTS];
+  int count;
+  int i;
+
+  stats_count(STATS_EVENT_SYSCALLS, 1);
+  count = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+  if (count < 0) {
+    return_error(errno != EINTR, RETVAL_OTHER);
+    count = 0;
+  }
+
+  for (i = 0; i < count; i++) {
+    call_handler((fcgi_event *) events[i].data.ptr, ready_mask(events[i].events));
+  }
+  return RETVAL_SUCCESS;
+}
+
+
+/*******************************************************************************/
+/* Wait up to "timeout" milliseconds (-1: forever), or until the next timer    */
+/* expires, and dispatch the ready events and the expired timers               */
+/*******************************************************************************/
+int event_dispatch(int timeout) {
+  fcgi_event * event;
+  fcgi_event * next;
+  int i;
+
+  for (event = always_ready; event != NULL; event = event->next_ready) {
+    if (event->mask != ZERO) { timeout = 0; break; }
+  }
+
+  if (uring_fd >= 0) {
+    return_error(uring_dispatch(timer_timeout(timeout)) != RETVAL_SUCCESS, RETVAL_OTHER);
+  } else {
+    return_error(epoll_dispatch(timer_timeout(timeout)) != RETVAL_SUCCESS, RETVAL_OTHER);
+  }
+
+  for (event = always_ready; event != NULL; event = next) {
+    next = event->next_ready;
+    call_handler(event, EVENT_READ | EVENT_WRITE);
+  }
+
+  expire_timers();
+
+  for (i = 0; i < deferred_count; i++) free(deferred[i]);
+  deferred_count = 0;
+
+  return RETVAL_SUCCESS;
+}
+
+
+
+/*******************************************************************************/
+/* The io_uring readiness backend, see config.io_uring                         */
+/*    - a listener, i.e., EVENT_ACCEPT, is a multishot IORING_OP_ACCEPT: each  */
+/*      completion is a connection, which its handler finds in event->accepted */
+/*    - an event_edge event is a multishot IORING_OP_POLL_ADD, which stays     */
+/*      armed: a change of its mask is an update of the poll, in place         */
+/*    - any other event is a one-shot poll, armed again once it completes      */
+/*      while the mask is not empty: it remains level-triggered, as with epoll */
+/*    - the events whose mask changes, or whose one-shot poll has completed,   */
+/*      are listed, and their polls queued, updated, or cancelled, just before */
+/*      the wait: the changes are submitted along with it, in a single         */
+/*      io_uring_enter, rather than an epoll_ctl each                          */
+/*                                                                             */
+/*  The user_data of a poll is a token that outlives its event: the poll of a  */
+/*  removed event is cancelled, and its token freed once its last completion,  */
+/*  i.e., without IORING_CQE_F_MORE, and that of its updates, are reaped.  An  */
+/*  update fails, e.g., with EALREADY while a wakeup of the poll is pending:   */
+/*  its user_data is the token, tagged with UPDATE_TAG, and it is retried.     */
+/*                                                                             */
+/*  A kernel without the multishot operations, i.e., before 5.19, fails them   */
+/*  with EINVAL: the events are then one-shot polls, and the listeners are     */
+/*  polled as well.                                                            */
+/*                                                                             */
+/*  Only the readiness goes through the ring, not the data path: the handlers  */
+/*  still make their own recv, send, read, write and splice system calls, and  */
+/*  there is no IORING_OP_RECV, SEND, READ, WRITE or SPLICE, nor registered    */
+/*  buffers.  event_syscalls counts the system calls of the event loop only.   */
+/*******************************************************************************/
+struct event_poll {
+  fcgi_event * event;           // NULL once the poll is cancelled
+  int multishot;                // The poll, or accept, completes more than once
+  int accept;                   // A multishot accept: a completion is a connection
+  int updates;                  // The updates in flight, see uring_update
+  int ended;                    // The last completion of the poll is reaped
+};
+
+#define UPDATE_TAG  ((uintptr_t) 1)     // The user_data of an update: its token, tagged
+
+static struct io_uring_params uring;
+static BYTE * uring_rings = NULL;       // The submission and completion rings, in a single mapping
+static size_t uring_size = 0;
+static struct io_uring_sqe * sqes = NULL;
+static unsigned sq_tail = 0;            // ... of the submissions not yet seen by the kernel
+static fcgi_event * changes = NULL;     // The events whose poll is to be queued
+static int multishot = NONZERO;         // The kernel supports the multishot operations
+
+#define SQ_RING(field)  ((unsigned *) (uring_rings + uring.sq_off.field))
+#define CQ_RING(field)  ((unsigned *) (uring_rings + uring.cq_off.field))
+
+
+static int uring_init(void) {
+  unsigned features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+  size_t sq_size;
+  size_t cq_size;
+  unsigned i;
+
+  memset(&uring, ZERO, sizeof(uring));
+  uring.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+  uring.cq_entries = URING_COMPLETIONS;
+
+  uring_fd = (int) syscall(SYS_io_uring_setup, URING_ENTRIES, &uring);
+  return_error(uring_fd < 0, RETVAL_OTHER);
+
+  sq_size = uring.sq_off.array + uring.sq_entries * sizeof(unsigned);
+  cq_size = uring.cq_off.cqes + uring.cq_entries * sizeof(struct io_uring_cqe);
+  uring_size = (sq_size > cq_size) ? sq_size : cq_size;
+
+  if ((uring.features & features) == features) {
+    uring_rings = mmap(NULL, uring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       uring_fd, IORING_OFF_SQ_RING);
+    sqes = mmap(NULL, uring.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_SQES);
+  }
+  if (uring_rings == NULL || uring_rings == MAP_FAILED || sqes == NULL || sqes == MAP_FAILED) {
+    if (uring_rings != NULL && uring_rings != MAP_FAILED) munmap(uring_rings, uring_size);
+    if (sqes != NULL && sqes != MAP_FAILED) munmap(sqes, uring.sq_entries * sizeof(struct io_uring_sqe));
+    close(uring_fd);
+    uring_fd = -1;
+    return RETVAL_OTHER;
+  }
+
+  // A submission is the entry of the same index
+  for (i = 0; i < uring.sq_entries; i++) SQ_RING(array)[i] = i;
+  sq_tail = *SQ_RING(tail);
+
+  return RETVAL_SUCCESS;
+}
+
+
+/*******************************************************************************/
+/* Submit the queued submissions, and wait for a completion if "timeout" is    */
+/* not 0: up to "timeout" milliseconds, or forever if -1                       */
+/*******************************************************************************/
+static int uring_enter(int timeout) {
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned submit;
+  long count;
+
+  __atomic_store_n(SQ_RING(tail), sq_tail, __ATOMIC_RELEASE);
+  submit = sq_tail - __atomic_load_n(SQ_RING(head), __ATOMIC_ACQUIRE);
+
+  memset(&arg, ZERO, sizeof(arg));
+  arg.sigmask_sz = _NSIG / 8;
+  if (timeout >= 0) {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (long long) (timeout % 1000) * 1000000;
+    arg.ts = (uintptr_t) &ts;
+  }
+
+  stats_count(STATS_EVENT_SYSCALLS, 1);
+  count = syscall(SYS_io_uring_enter, uring_fd, submit, (timeout == 0) ? 0 : 1,
+                  IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+  // The submissions that are not consumed, e.g., while the completions overflow, are retried
+  return_error(count < 0 && errno != EINTR && errno != ETIME && errno != EAGAIN && errno != EBUSY,
+               RETVAL_OTHER);
+  return RETVAL_SUCCESS;
+}
+
+
+// A free submission, or NULL: the submission queue is flushed once full
+static struct io_uring_sqe * uring_sqe(void) {
+  struct io_uring_sqe * sqe;
+
+  if (sq_tail - __atomic_load_n(SQ_RING(head), __ATOMIC_ACQUIRE) == uring.sq_entries) {
+    uring_enter(0);
+    if (sq_tail - __atomic_load_n(SQ_RING(head), __ATOMIC_ACQUIRE) == uring.sq_entries) return NULL;
+  }
+
+  sqe = &sqes[sq_tail & *SQ_RING(ring_mask)];
+  memset(sqe, ZERO, sizeof(struct io_uring_sqe));
+  sq_tail ++;
+  stats_count(STATS_EVENT_CHANGES, 1);
+  return sqe;
+}
+
+
+static void uring_cancel(fcgi_event * event) {
+  struct io_uring_sqe * sqe = uring_sqe();
+
+  // The completion of the cancel itself has no token, and is ignored
+  if (sqe != NULL) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t) event->poll;
+  }
+  event->poll->event = NULL;
+  event->poll = NULL;
+  event->registered = ZERO;
+}
+
+
+// The poll32_events of a submission
+static unsigned uring_events(int mask) {
+  unsigned events = epoll_mask(mask);
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+  events = (events << 16) | (events >> 16);     // poll32_events is word-reversed
+#endif
+  return events;
+}
+
+
+static int uring_poll(fcgi_event * event) {
+  struct event_poll * poll;
+  struct io_uring_sqe * sqe;
+
+  poll = (struct event_poll *) malloc(sizeof(struct event_poll));
+  return_error(poll == NULL, RETVAL_MEMORY_ERR);
+  sqe = uring_sqe();
+  if (sqe == NULL) {
+    free(poll);
+    return RETVAL_OTHER;
+  }
+
+  poll->updates = 0;
+  poll->ended = ZERO;
+  poll->multishot = multishot && (event->edge || (event->mask & EVENT_ACCEPT));
+  poll->accept = poll->multishot && (event->mask & EVENT_ACCEPT);
+  if (poll->accept) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  } else {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = uring_events(event->mask);
+    if (poll->multishot) sqe->len = IORING_POLL_ADD_MULTI;
+  }
+  sqe->fd = event->fd;
+  sqe->user_data = (uintptr_t) poll;
+
+  poll->event = event;
+  event->poll = poll;
+  event->registered = event->mask;
+  return RETVAL_SUCCESS;
+}
+
+
+// The new mask of a multishot poll, which stays armed
+static int uring_update(fcgi_event * event) {
+  struct io_uring_sqe * sqe = uring_sqe();
+
+  return_error(sqe == NULL, RETVAL_OTHER);
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->addr = (uintptr_t) event->poll;
+  sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;
+  sqe->poll32_events = uring_events(event->mask);
+  sqe->user_data = (uintptr_t) event->poll | UPDATE_TAG;
+
+  event->poll->updates ++;
+  event->registered = event->mask;
+  return RETVAL_SUCCESS;
+}
+
+
+// The completion of an update: a poll that is still armed keeps its mask
+static void uring_updated(struct event_poll * poll, int res) {
+  poll->updates --;
+  if (res < 0 && ! poll->ended && poll->event != NULL) {
+    poll->event->registered = ZERO;
+    uring_modify(poll->event);
+  }
+  if (poll->ended && poll->updates == 0) free(poll);
+}
+
+
+// Queue, update, or cancel, the polls of the events that have changed
+static void uring_changes(void) {
+  fcgi_event * event;
+  int retval;
+
+  while ((event = changes) != NULL) {
+    changes = event->next_ready;
+    event->next_ready = NULL;
+    event->changed = ZERO;
+
+    if (event->poll != NULL && epoll_mask(event->registered) == epoll_mask(event->mask)) continue;
+    if (event->poll != NULL && event->poll->multishot && event->mask != ZERO && ! (event->mask & EVENT_ACCEPT)) {
+      retval = uring_update(event);
+    } else {
+      if (event->poll != NULL) uring_cancel(event);
+      retval = (event->mask != ZERO) ? uring_poll(event) : RETVAL_SUCCESS;
+    }
+    if (retval != RETVAL_SUCCESS) {
+      // Retried before the next wait
+      event->changed = NONZERO;
+      event->next_ready = changes;
+      changes = event;
+      break;
+    }
+  }
+}
+
+
+static int uring_modify(fcgi_event * event) {
+  if (! event->changed) {
+    event->changed = NONZERO;
+    event->next_ready = changes;
+    changes = event;
+  }
+  return RETVAL_SUCCESS;
+}
+
+
+static void uring_remove(fcgi_event * event) {
+  fcgi_event ** p;
+
+  if (event->changed) {
+    for (p = &changes; *p != NULL; p = &(*p)->next_ready) {
+      if (*p == event) { *p = event->next_ready; break; }
+    }
+    event->next_ready = NULL;
+    event->changed = ZERO;
+  }
+  if (event->poll != NULL) uring_cancel(event);
+}
+
+
+// A completion of the multishot accept of a listener: the handler takes the
+// connection, or accepts on its own after an error, e.g., EMFILE
+static void uring_accepted(fcgi_event * event, int fd) {
+  if (event == NULL) {
+    if (fd >= 0) close(fd);
+    return;
+  }
+
+  event->accepted = fd;
+  call_handler(event, EVENT_READ);
+  if (event->accepted >= 0) close(event->accepted);
+  event->accepted = -1;
+}
+
+
+static int uring_dispatch(int timeout) {
+  struct io_uring_cqe cqe;
+  struct event_poll * token;
+  struct event_poll poll;
+  unsigned head;
+
+  uring_changes();
+  if (changes != NULL) timeout = 0;
+  return_error(uring_enter(timeout) != RETVAL_SUCCESS, RETVAL_OTHER);
+
+  for (head = *CQ_RING(head); head != __atomic_load_n(CQ_RING(tail), __ATOMIC_ACQUIRE); head++) {
+    cqe = ((struct io_uring_cqe *) CQ_RING(cqes))[head & *CQ_RING(ring_mask)];
+    __atomic_store_n(CQ_RING(head), head + 1, __ATOMIC_RELEASE);
+
+    if (cqe.user_data == 0) continue;
+    if (cqe.user_data & UPDATE_TAG) {
+      uring_updated((struct event_poll *) (uintptr_t) (cqe.user_data & ~UPDATE_TAG), cqe.res);
+      continue;
+    }
+    token = (struct event_poll *) (uintptr_t) cqe.user_data;
+    poll = *token;
+
+    // The last completion of the poll: it is armed again before the next wait,
+    // unless the mask is then empty
+    if (! (cqe.flags & IORING_CQE_F_MORE)) {
+      token->ended = NONZERO;
+      if (token->updates == 0) free(token);
+      if (poll.event != NULL) {
+        poll.event->poll = NULL;
+        poll.event->registered = ZERO;
+        uring_modify(poll.event);
+      }
+
+      // A kernel without the multishot operations: polled again, one-shot
+      if (poll.multishot && cqe.res == -EINVAL) {
+        multishot = ZERO;
+        continue;
+      }
+    }
+
+    if (poll.accept) {
+      uring_accepted(poll.event, cqe.res);
+    } else if (poll.event != NULL) {
+      call_handler(poll.event, (cqe.res < 0) ? EVENT_READ | EVENT_WRITE | EVENT_HANGUP : ready_mask(cqe.res));
+    }
+  }
+  return RETVAL_SUCCESS;
+}
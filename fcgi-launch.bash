@@ -7,6 +7,7 @@
 #
 # In our implementation, we rely on existing programs, stitched together via a bash script, to reduce development time.
 #   It is would be straight forward to implement the fcgi-launch program in C to improve performance.
+#   See fcgi-launch.c, which keeps the same usage; this script remains for comparison.
 
 # This bash script relies on only three existing programs:
 #   - socket: manages the server-side TCP socket, and wires this communication to fcgi2env-exec program's stdin/out
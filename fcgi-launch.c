@@ -0,0 +1,430 @@
+/*******************************************************************************/
+/*  The fcgi-launch program:                                                   */
+/*     - listens on a socket ADDR:PORT, and/or a Unix socket PATH              */
+/*     - accepts each connection via the epoll, or io_uring, event loop        */
+/*     - serves the FCGI requests on all connections in-process                */
+/*     - optionally, serves SCGI requests on a second port, alike              */
+/*     - spawns only the children that exec the CGI program, or a pool of      */
+/*       persistent workers, or calls a handler plugin instead                 */
+/*                                                                             */
+/*  This is the C implementation of fcgi-launch.bash.  The bash prototype      */
+/*  uses the "socket" program, which forks and then execs fcgi2env-exec for    */
+/*  each connection.  Here the FCGI protocol is handled within the daemon      */
+/*  itself, see "fcgi-connection.c" and "fcgi-responder.c".                    */
+/*                                                                             */
+/*  Usage:  fcgi-launch [-F] [-o SIZE] [-d MS] [-c N] [-q N] [-w MS]            */
+/*                      [-C KB] [-T SECONDS] [-K NAMES]                        */
+/*                      [-S FILE] [-I MS] [-U SOCKET] [-s SCGI_PORT]           */
+/*                      [-P N] [-R N] [-Z] [-e BYTES] [-E]                     */
+/*                      [-t MS] [-g MS] [-H] [-b KB] [-u] [-N N] [-A]          */
+/*                      [-m BYTES]                                             */
+/*                      [-L PATH [-M MODE] [-G GROUP]]                         */
+/*                      [-a KB] [-x SECONDS] [-k NAMES] [-p]                   */
+/*                      ADDR PORT CGI_PROGRAM | -L PATH ... CGI_PROGRAM        */
+/*     -F:  remain in the foreground, i.e., do not become a daemon             */
+/*     -o:  coalesce the output of a CGI program into records of SIZE bytes    */
+/*     -d:  ... but send it after at most MS milliseconds                      */
+/*     -m:  end a request whose PARAMS exceed BYTES with a 431 Status          */
+/*          (default: 1048576, 0: no limit)                                    */
+/*     -c:  run at most N CGI programs at the same time (default: no limit)    */
+/*     -q:  beyond that, at most N requests wait (default: 100)                */
+/*     -w:  ... for at most MS milliseconds (default: 1000), otherwise the     */
+/*          request ends with FCGI_OVERLOADED                                  */
+/*     -C:  cache the responses to GET and HEAD requests in KB of memory       */
+/*     -T:  ... for SECONDS (default: 60), unless their headers say otherwise  */
+/*     -K:  ... keyed on the PARAMS NAMES, separated by commas (default:       */
+/*          HTTP_HOST,SCRIPT_NAME,PATH_INFO,QUERY_STRING)                      */
+/*     -S:  write the statistics, in JSON, to FILE                             */
+/*     -I:  ... every MS milliseconds (default: 1000)                          */
+/*     -U:  send the statistics to each client of the Unix SOCKET              */
+/*     -s:  also listen on ADDR:SCGI_PORT for SCGI requests                    */
+/*     -P:  serve the requests with N persistent workers, see fcgi-pool.c      */
+/*     -R:  ... each replaced after N requests (default: no limit)             */
+/*     -Z:  fork the children from a zygote process, see fcgi-spawn.c          */
+/*     -e:  send at most BYTES of a child's stderr as FCGI_STDERR, and drop    */
+/*          the rest (default: 65536, 0: no limit)                             */
+/*     -E:  drop the stderr of a child, rather than pause it, while the        */
+/*          connection is backlogged                                           */
+/*     -t:  end a request after MS milliseconds (default: no limit)            */
+/*     -g:  a child that is terminated, e.g., at the end of its request, is    */
+/*          sent SIGTERM, then SIGKILL after MS milliseconds (default: 1000)   */
+/*     -H:  the end of a connection's input aborts its requests, i.e., the     */
+/*          Web server does not half-close its connections                     */
+/*     -b:  receive each request body before its CGI program starts, in KB of  */
+/*          memory, then in a temporary file, and make it the program's stdin  */
+/*     -u:  wait for readiness via io_uring, rather than epoll, if the kernel  */
+/*          allows it, see fcgi-event.c                                        */
+/*     -N:  run N shards, i.e., daemons that each listen on ADDR:PORT, with    */
+/*          SO_REUSEPORT (0: one per CPU), see fcgi-shard.c                    */
+/*     -A:  ... each bound to a CPU                                            */
+/*     -L:  also, or only, listen on the Unix socket PATH, e.g., for a Web     */
+/*          server on the same host                                            */
+/*     -M:  ... with the permissions MODE, in octal (default: as per umask)    */
+/*     -G:  ... and the group GROUP                                            */
+/*     -a:  cache the AUTHORIZER decisions that allow access in KB of memory   */
+/*     -x:  ... for SECONDS (default: 10), unless their headers say otherwise  */
+/*     -k:  ... keyed on the PARAMS NAMES, separated by commas (default:       */
+/*          HTTP_HOST,REQUEST_URI,HTTP_AUTHORIZATION,HTTP_COOKIE)              */
+/*     -p:  CGI_PROGRAM is a handler plugin, i.e., a shared object, that is    */
+/*          called in-process, or with -P by the workers, see fcgi-plugin.h    */
+/*                                                                             */
+/*  Build:  cc -o fcgi-launch fcgi-launch.c fcgi-event.c fcgi-buffer.c \       */
+/*             fcgi-record.c fcgi-cache.c fcgi-stats.c fcgi-connection.c \     */
+/*             fcgi-scgi.c fcgi-responder.c fcgi-pool.c fcgi-spawn.c \         */
+/*             fcgi-shard.c fcgi-plugin.c -ldl                                 */
+/*                                                                             */
+/*******************************************************************************/
+
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <grp.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include "fcgi-daemon.h"
+
+
+#define LISTEN_BACKLOG       (128)
+#define PLUGIN_SPOOL_MEMORY  (1024 * 1024)   // See -p, without -b
+
+
+fcgi_config config = CONFIG_DEFAULTS;
+
+
+static void usage(void) {
+  fprintf(stderr, "Usage: fcgi-launch [-F] [-o SIZE] [-d MS] [-c N] [-q N] [-w MS]"
+                  " [-C KB] [-T SECONDS] [-K NAMES] [-S FILE] [-I MS] [-U SOCKET]\n"
+                  "                   [-s SCGI_PORT] [-P N] [-R N] [-Z] [-e BYTES] [-E]\n"
+                  "                   [-t MS] [-g MS] [-H] [-b KB] [-u] [-N N] [-A] [-m BYTES]\n"
+                  "                   [-L PATH [-M MODE] [-G GROUP]] [-a KB] [-x SECONDS] [-k NAMES] [-p]\n"
+                  "                   ADDR PORT CGI_PROGRAM | -L PATH ... CGI_PROGRAM\n");
+  exit(1);
+}
+
+
+// A numeric option within [min, max]
+static int number(char * arg, int min, int max) {
+  char * end;
+  long value;
+
+  value = strtol(arg, &end, 10);
+  if (*arg == '\0' || *end != '\0' || value < min || value > max) usage();
+  return (int) value;
+}
+
+
+// The permissions of a file, in octal
+static int mode_number(char * arg) {
+  char * end;
+  long value;
+
+  value = strtol(arg, &end, 8);
+  if (*arg == '\0' || *end != '\0' || value < 0 || value > 0777) usage();
+  return (int) value;
+}
+
+
+// A group, by name or number
+static gid_t group_number(char * arg) {
+  struct group * group = getgrnam(arg);
+  char * end;
+  long value;
+
+  if (group != NULL) return group->gr_gid;
+  value = strtol(arg, &end, 10);
+  if (*arg == '\0' || *end != '\0' || value < 0) {
+    fprintf(stderr, "Error: %s is not a group\n", arg);
+    exit(1);
+  }
+  return (gid_t) value;
+}
+
+
+// A path that remains valid once the daemon has changed its directory to "/"
+static char * absolute_path(char * path) {
+  char cwd[PATH_MAX];
+  char * result;
+
+  if (path == NULL || path[0] == '/' || getcwd(cwd, sizeof(cwd)) == NULL) return path;
+  if (asprintf(&result, "%s/%s", cwd, path) < 0) return path;
+  return result;
+}
+
+
+/*******************************************************************************/
+/* Create a listening socket bound to ADDR:PORT                                 */
+/*******************************************************************************/
+static int listen_on(char * addr, char * port) {
+  struct addrinfo hints;
+  struct addrinfo * result;
+  struct addrinfo * rp;
+  int listen_fd = -1;
+  int one = 1;
+
+  memset(&hints, ZERO, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  if (getaddrinfo(addr, port, &hints, &result) != 0) return -1;
+
+  for (rp = result; rp != NULL; rp = rp->ai_next) {
+    listen_fd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, rp->ai_protocol);
+    if (listen_fd < 0) continue;
+
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (config.shards != 0) setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    if (bind(listen_fd, rp->ai_addr, rp->ai_addrlen) == 0 &&
+        listen(listen_fd, LISTEN_BACKLOG) == 0) break;
+
+    close(listen_fd);
+    listen_fd = -1;
+  }
+  freeaddrinfo(result);
+
+  return listen_fd;
+}
+
+
+/*******************************************************************************/
+/* Create a listening Unix socket at PATH                                      */
+/*    - a socket left by a previous daemon is replaced, once a connect()       */
+/*      to it is refused: one that a running daemon still listens on, or a     */
+/*      path that is not a socket, is left alone, and the listen fails         */
+/*    - its permissions are MODE, or as per the umask if -1, and its group is  */
+/*      GROUP, if not -1: it is bound without any permission, so that it is    */
+/*      never more open than that                                              */
+/*******************************************************************************/
+static int listen_unix(char * path, int mode, gid_t group) {
+  struct sockaddr_un addr;
+  struct stat st;
+  mode_t umask_mode;
+  int probe_fd;
+  int refused;
+  int bound;
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+  memset(&addr, ZERO, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  if (lstat(path, &st) == 0) {
+    if (! S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "Error: %s exists and is not a socket\n", path);
+      return -1;
+    }
+    probe_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe_fd < 0) return -1;
+    refused = (connect(probe_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 && errno == ECONNREFUSED);
+    close(probe_fd);
+    if (! refused) {
+      fprintf(stderr, "Error: %s is in use, e.g., by a running daemon\n", path);
+      return -1;
+    }
+    unlink(path);
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+
+  umask_mode = umask(0777);
+  bound = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+  umask(umask_mode);
+  if (mode < 0) mode = 0666 & ~umask_mode;
+
+  if (bound != 0 || (group != (gid_t) -1 && chown(path, -1, group) != 0)
+      || chmod(path, mode) != 0 || listen(fd, LISTEN_BACKLOG) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+// A listener for each shard, bound to the same ADDR:PORT, see fcgi-shard.c
+static int * listen_shards(char * addr, char * port) {
+  int count = (config.shards == 0) ? 1 : config.shards;
+  int * fds;
+  int i;
+
+  fds = (int *) calloc(count, sizeof(int));
+  exit_error(fds == NULL, RETVAL_MEMORY_ERR);
+
+  for (i = 0; i < count; i++) {
+    fds[i] = listen_on(addr, port);
+    if (fds[i] < 0) {
+      fprintf(stderr, "Error: unable to listen on %s:%s\n", addr, port);
+      exit(1);
+    }
+  }
+  return fds;
+}
+
+
+// ... of which a shard keeps its own
+static int shard_listener(int * fds, int shard) {
+  int i;
+
+  for (i = 0; i < config.shards; i++) {
+    if (i != shard) close(fds[i]);
+  }
+  return fds[shard];
+}
+
+
+static int fcgi_protocol = PROTOCOL_FCGI;      // See connection_accept
+static int scgi_protocol = PROTOCOL_SCGI;
+
+
+int main(int argc, char * argv[]) {
+  int foreground = 0;
+  int opt;
+
+  char * addr = NULL;
+  char * port = NULL;
+  char * scgi_port = NULL;
+  char * unix_path = NULL;
+  int unix_mode = -1;
+  gid_t unix_group = (gid_t) -1;
+  char program[PATH_MAX];
+
+  int * listen_fds = NULL;
+  int * scgi_fds = NULL;
+  int listen_fd = -1;
+  int scgi_fd = -1;
+  int unix_fd = -1;
+  int shard;
+  int io_uring;
+  fcgi_event listener;
+  fcgi_event scgi_listener;
+  fcgi_event unix_listener;
+
+
+  while ((opt = getopt(argc, argv, "Fo:d:m:c:q:w:C:T:K:S:I:U:s:P:R:Ze:Et:g:Hb:uN:AL:M:G:a:x:k:p")) != -1) {
+    switch (opt) {
+    case 'F': foreground = 1; break;
+    case 'o': config.output_size = number(optarg, 1, FCGI_MAX_CONTENT_LEN); break;
+    case 'd': config.flush_delay = number(optarg, 0, 60000); break;
+    case 'm': config.max_params_bytes = number(optarg, 0, INT_MAX); break;
+    case 'c': config.max_children = number(optarg, 0, 1000000); break;
+    case 'q': config.max_waiting = number(optarg, 0, 1000000); break;
+    case 'w': config.wait_timeout = number(optarg, 0, INT_MAX); break;
+    case 'C': config.cache_size = (size_t) number(optarg, 0, INT_MAX) * 1024; break;
+    case 'T': config.cache_ttl = number(optarg, 1, INT_MAX / 1000); break;
+    case 'K': config.cache_key = optarg; break;
+    case 'S': config.stats_file = optarg; break;
+    case 'I': config.stats_interval = number(optarg, 1, INT_MAX); break;
+    case 'U': config.stats_socket = optarg; break;
+    case 's': scgi_port = optarg; break;
+    case 'P': config.pool_size = number(optarg, 0, 100000); break;
+    case 'R': config.pool_max_requests = number(optarg, 0, INT_MAX); break;
+    case 'Z': config.zygote = 1; break;
+    case 'e': config.stderr_limit = number(optarg, 0, INT_MAX); break;
+    case 'E': config.stderr_drop = 1; break;
+    case 't': config.request_timeout = number(optarg, 0, INT_MAX); break;
+    case 'g': config.kill_grace = number(optarg, 0, INT_MAX); break;
+    case 'H': config.abort_hangup = 1; break;
+    case 'b': config.spool_memory = (size_t) number(optarg, 0, INT_MAX) * 1024; break;
+    case 'u': config.io_uring = 1; break;
+    case 'N': config.shards = number(optarg, 0, 1024); if (config.shards == 0) config.shards = shard_cpus(); break;
+    case 'A': config.shard_affinity = 1; break;
+    case 'L': unix_path = optarg; break;
+    case 'M': unix_mode = mode_number(optarg); break;
+    case 'G': unix_group = group_number(optarg); break;
+    case 'a': config.auth_cache_size = (size_t) number(optarg, 0, INT_MAX) * 1024; break;
+    case 'x': config.auth_ttl = number(optarg, 1, INT_MAX / 1000); break;
+    case 'k': config.auth_key = optarg; break;
+    case 'p': config.plugin = 1; break;
+    default:  usage();
+    }
+  }
+
+  // With a Unix socket, ADDR and PORT are optional
+  if (argc - optind == 3) {
+    addr = argv[optind];
+    port = argv[optind + 1];
+    optind += 2;
+  } else if (argc - optind != 1 || unix_path == NULL || scgi_port != NULL) {
+    usage();
+  }
+  if (realpath(argv[optind], program) == NULL || access(program, config.plugin ? R_OK : X_OK) != 0) {
+    fprintf(stderr, "Error: %s program is invalid\n", argv[optind]);
+    exit(1);
+  }
+
+  // The plugin is loaded once, before the shards and the workers are forked.
+  // In-process, it reads the whole body, see call_plugin.
+  if (config.plugin) {
+    if (plugin_load(program) != RETVAL_SUCCESS) exit(1);
+    if (config.pool_size == 0 && config.spool_memory == 0) config.spool_memory = PLUGIN_SPOOL_MEMORY;
+  }
+
+
+  if (addr != NULL) listen_fds = listen_shards(addr, port);
+  if (scgi_port != NULL) scgi_fds = listen_shards(addr, scgi_port);
+
+  // The shards share a single Unix socket: SO_REUSEPORT applies to TCP only
+  if (unix_path != NULL) {
+    unix_fd = listen_unix(unix_path, unix_mode, unix_group);
+    if (unix_fd < 0) {
+      fprintf(stderr, "Error: unable to listen on %s\n", unix_path);
+      exit(1);
+    }
+  }
+
+  // A client that disconnects early must not terminate the daemon
+  signal(SIGPIPE, SIG_IGN);
+
+  config.stats_file = absolute_path(config.stats_file);
+  config.stats_socket = absolute_path(config.stats_socket);
+
+  if (! foreground && daemon(0, 1) != 0) {
+    perror("daemon");
+    exit(1);
+  }
+
+
+  config.program = program;
+
+  // From here on, within each shard
+  shard = shard_start();
+  if (listen_fds != NULL) listen_fd = shard_listener(listen_fds, shard);
+  if (scgi_fds != NULL) scgi_fd = shard_listener(scgi_fds, shard);
+
+  io_uring = config.io_uring;
+  exit_error(event_init() != RETVAL_SUCCESS, RETVAL_OTHER);
+  if (io_uring && ! config.io_uring) fprintf(stderr, "Warning: io_uring is unavailable, the event loop uses epoll\n");
+  exit_error(responder_init() != RETVAL_SUCCESS, RETVAL_OTHER);
+  if (stats_init() != RETVAL_SUCCESS) {
+    fprintf(stderr, "Error: unable to report the statistics\n");
+    exit(1);
+  }
+  if (listen_fd >= 0) {
+    exit_error(event_add(&listener, listen_fd, EVENT_READ | EVENT_ACCEPT, connection_accept, &fcgi_protocol) != RETVAL_SUCCESS, RETVAL_OTHER);
+  }
+  if (scgi_fd >= 0) {
+    exit_error(event_add(&scgi_listener, scgi_fd, EVENT_READ | EVENT_ACCEPT, connection_accept, &scgi_protocol) != RETVAL_SUCCESS, RETVAL_OTHER);
+  }
+  if (unix_fd >= 0) {
+    exit_error(event_add(&unix_listener, unix_fd, EVENT_READ | EVENT_ACCEPT, connection_accept, &fcgi_protocol) != RETVAL_SUCCESS, RETVAL_OTHER);
+  }
+
+  for (;;) {
+    exit_error(event_dispatch(-1) != RETVAL_SUCCESS, RETVAL_OTHER);
+  }
+}
@@ -0,0 +1,241 @@
+/*******************************************************************************/
+/*  Handler plugins, see fcgi-launch -p and "fcgi-plugin.h":                   */
+/*     - the shared object config.program is loaded at startup, with dlopen()  */
+/*     - its fcgi_handle() serves each request in place of a CGI program       */
+/*     - without config.pool_size, the handler is called in-process, by the    */
+/*       event loop, once the body has been spooled, see call_plugin in        */
+/*       "fcgi-responder.c"                                                    */
+/*     - with config.pool_size, the handler is called by the workers of the    */
+/*       pool instead, for isolation: each worker is a fork of the daemon      */
+/*       that serves the loop protocol of "fcgi-pool.c"; a worker that         */
+/*       crashes is replaced, and only its request fails                       */
+/*                                                                             */
+/*  A handler runs to completion: while it runs in-process, the other          */
+/*  requests of the daemon, or of its shard, wait, and a crash ends the        */
+/*  process.                                                                   */
+/*                                                                             */
+/*******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <dlfcn.h>
+
+#include <sys/prctl.h>
+
+#include "fcgi-daemon.h"
+
+
+#define WORKER_READ_SIZE   (64 * 1024)
+#define WORKER_FLUSH_SIZE  (64 * 1024)    // The output of a worker is written in chunks of this size
+
+
+static fcgi_plugin_handle handle = NULL;
+static fcgi_plugin_init init = NULL;
+
+
+
+/*******************************************************************************/
+/* Loading the plugin: returns RETVAL_SUCCESS, or prints the error             */
+/*******************************************************************************/
+int plugin_load(const char * path) {
+  void * object;
+
+  object = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (object != NULL) handle = (fcgi_plugin_handle) dlsym(object, FCGI_PLUGIN_HANDLE);
+  if (handle == NULL) {
+    fprintf(stderr, "Error: %s\n", dlerror());
+    return RETVAL_OTHER;
+  }
+
+  // fcgi_init() is optional
+  init = (fcgi_plugin_init) dlsym(object, FCGI_PLUGIN_INIT);
+  return RETVAL_SUCCESS;
+}
+
+
+// Before the first request of this process
+int plugin_init(void) {
+  if (init == NULL) return RETVAL_SUCCESS;
+  return_error(init() != 0, RETVAL_OTHER);
+  return RETVAL_SUCCESS;
+}
+
+
+int plugin_handle(char ** params, fcgi_plugin_io * io) {
+  stats_count(STATS_PLUGIN_CALLS, 1);
+  return handle(params, io);
+}
+
+
+
+/*******************************************************************************/
+/* A worker of the pool, see "fcgi-pool.c"                                     */
+/*    - its stdin is buffered: a chunk of the body is read by the handler as   */
+/*      it comes, see worker_read                                              */
+/*    - its output is framed into chunks of up to WORKER_FLUSH_SIZE            */
+/*    - the rest of the body, if the handler has not read it, is read before   */
+/*      the end of the response, as per the protocol                           */
+/*******************************************************************************/
+static fcgi_buffer input;
+static fcgi_buffer output;
+static size_t remaining;                // The rest of the current chunk of the body
+static int body_ended;
+
+
+// More of stdin: returns ZERO at its end
+static int worker_fill(void) {
+  BYTE * space = buffer_reserve(&input, WORKER_READ_SIZE);
+  ssize_t count;
+
+  if (space == NULL) return ZERO;
+  do {
+    count = read(0, space, WORKER_READ_SIZE);
+  } while (count < 0 && errno == EINTR);
+
+  if (count <= 0) return ZERO;
+  buffer_commit(&input, count);
+  return NONZERO;
+}
+
+
+// The length of the next chunk, or -1 at the end of stdin
+static long long chunk_length(void) {
+  BYTE * eol;
+  long long length;
+
+  while (buffer_length(&input) == 0 || (eol = memchr(buffer_data(&input), '\n', buffer_length(&input))) == NULL) {
+    if (! worker_fill()) return -1;
+  }
+  length = atoll((const char *) buffer_data(&input));
+  buffer_consume(&input, eol + 1 - buffer_data(&input));
+  return length;
+}
+
+
+static int write_all(const BYTE * data, size_t length) {
+  ssize_t count;
+
+  while (length != 0) {
+    count = write(1, data, length);
+    if (count < 0 && errno == EINTR) continue;
+    return_error(count <= 0, RETVAL_READ_WRITE_ERR);
+    data += count;
+    length -= count;
+  }
+  return RETVAL_SUCCESS;
+}
+
+
+static ssize_t worker_read(fcgi_plugin_io * io, void * buffer, size_t length) {
+  long long chunk;
+
+  while (remaining == 0) {
+    if (body_ended) return 0;
+    chunk = chunk_length();
+    if (chunk < 0) _exit(0);            // The daemon has closed the pipe
+    if (chunk == 0) body_ended = NONZERO;
+    remaining = (size_t) chunk;
+  }
+
+  if (buffer_length(&input) == 0 && ! worker_fill()) _exit(0);
+  if (length > remaining) length = remaining;
+  if (length > buffer_length(&input)) length = buffer_length(&input);
+
+  memcpy(buffer, buffer_data(&input), length);
+  buffer_consume(&input, length);
+  remaining -= length;
+  return length;
+}
+
+
+static ssize_t worker_write(fcgi_plugin_io * io, const void * data, size_t length) {
+  if (length == 0) return 0;
+  return_error(pool_frame(&output, data, length) != RETVAL_SUCCESS, -1);
+
+  if (buffer_length(&output) >= WORKER_FLUSH_SIZE) {
+    return_error(write_all(buffer_data(&output), buffer_length(&output)) != RETVAL_SUCCESS, -1);
+    buffer_consume(&output, buffer_length(&output));
+  }
+  return length;
+}
+
+
+static void worker_main(void) {
+  static BYTE discard[WORKER_READ_SIZE];
+  fcgi_plugin_io io = { worker_read, worker_write };
+  fcgi_buffer env = { NULL, 0, 0, 0 };
+  char ** params;
+  char * p;
+  long long length;
+  size_t count;
+  char line[24];
+  int status;
+
+  exit_error(plugin_init() != RETVAL_SUCCESS, RETVAL_OTHER);
+
+  while ((length = chunk_length()) >= 0) {
+    // The environment, followed by the vector of its strings
+    env.start = env.end = 0;
+    while ((size_t) length > buffer_length(&input)) {
+      if (! worker_fill()) _exit(0);
+    }
+    exit_error(buffer_append(&env, buffer_data(&input), length) != RETVAL_SUCCESS, RETVAL_MEMORY_ERR);
+    exit_error(buffer_append(&env, "", 1) != RETVAL_SUCCESS, RETVAL_MEMORY_ERR);
+    buffer_consume(&input, length);
+
+    count = 0;
+    for (p = (char *) env.data; *p != '\0'; p += strlen(p) + 1) count++;
+    params = (char **) calloc(count + 1, sizeof(char *));
+    exit_error(params == NULL, RETVAL_MEMORY_ERR);
+    count = 0;
+    for (p = (char *) env.data; *p != '\0'; p += strlen(p) + 1) params[count++] = p;
+
+    remaining = 0;
+    body_ended = ZERO;
+    status = plugin_handle(params, &io);
+    free(params);
+
+    while (worker_read(&io, discard, sizeof(discard)) > 0) ;
+
+    snprintf(line, sizeof(line), (status != 0) ? "0 %d\n" : "0\n", status);
+    if (buffer_append(&output, line, strlen(line)) != RETVAL_SUCCESS
+        || write_all(buffer_data(&output), buffer_length(&output)) != RETVAL_SUCCESS) _exit(0);
+    buffer_consume(&output, buffer_length(&output));
+  }
+  _exit(0);
+}
+
+
+/*******************************************************************************/
+/* Fork a worker: returns its pid, or -1 and errno, as spawn_program does      */
+/*******************************************************************************/
+pid_t plugin_fork(int stdin_fd, int stdout_fd) {
+  sigset_t mask;
+  pid_t pid = fork();
+
+  if (pid != SELF) {
+    // As the worker does, so that its group exists once the daemon has its pid
+    if (pid > 0) setpgid(pid, pid);
+    return pid;
+  }
+
+  // Only its pipes are kept, e.g., not the listeners, nor the connections
+  dup2(stdin_fd, 0);
+  dup2(stdout_fd, 1);
+  close_range(3, ~0U, 0);
+  setpgid(0, 0);
+
+  sigemptyset(&mask);
+  sigprocmask(SIG_SETMASK, &mask, NULL);
+  signal(SIGPIPE, SIG_DFL);
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+  worker_main();
+  return -1;
+}
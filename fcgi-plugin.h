@@ -0,0 +1,47 @@
+/*****************************************************************************/
+/*  The interface of a handler plugin, see fcgi-launch -p                    */
+/*                                                                           */
+/*  A plugin is a shared object that serves the requests in place of a CGI   */
+/*  program, without a fork or an exec per request:                          */
+/*                                                                           */
+/*      cc -shared -fPIC -I. -o handler.so handler.c                         */
+/*      fcgi-launch -p 127.0.0.1 9000 ./handler.so                           */
+/*                                                                           */
+/*  It exports fcgi_handle(), and optionally fcgi_init().  The handler       */
+/*  receives what a CGI program would:                                       */
+/*     - params:  the CGI variables, "name=value", NULL terminated, as an    */
+/*                environ; valid until the handler returns                   */
+/*     - io:      io->read() returns the next bytes of the body, as stdin    */
+/*                would, i.e., 0 at its end; io->write() appends to the CGI  */
+/*                output, i.e., headers, a blank line, and the content       */
+/*  and returns the appStatus, as a CGI program's exit status.               */
+/*                                                                           */
+/*  fcgi_init() is called once in each process that calls the handler,       */
+/*  before the first request: a non-zero result ends that process.           */
+/*                                                                           */
+/*  A handler runs to completion, see "fcgi-plugin.c": it must not block.    */
+/*****************************************************************************/
+
+#ifndef FCGI_PLUGIN_H
+#define FCGI_PLUGIN_H
+
+#include <sys/types.h>
+
+
+typedef struct fcgi_plugin_io fcgi_plugin_io;
+
+struct fcgi_plugin_io {
+  ssize_t (* read)(fcgi_plugin_io * io, void * buffer, size_t length);       // -1 on error
+  ssize_t (* write)(fcgi_plugin_io * io, const void * data, size_t length);  // ... otherwise "length"
+};
+
+typedef int (* fcgi_plugin_handle)(char ** params, fcgi_plugin_io * io);
+typedef int (* fcgi_plugin_init)(void);
+
+#define FCGI_PLUGIN_HANDLE  "fcgi_handle"
+#define FCGI_PLUGIN_INIT    "fcgi_init"
+
+int fcgi_handle(char ** params, fcgi_plugin_io * io);
+int fcgi_init(void);
+
+#endif
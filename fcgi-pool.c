@@ -0,0 +1,323 @@
+/*******************************************************************************/
+/*  The worker pool, as php-fpm: persistent CGI programs                       */
+/*     - config.pool_size workers are started with the daemon, each runs the   */
+/*       CGI program with FCGI_WORKER=1 as its environment                     */
+/*     - each request is dispatched to an idle worker, i.e., without a fork    */
+/*       or an exec, see admit_child in "fcgi-responder.c"                     */
+/*     - a worker is replaced after config.pool_max_requests requests, or once */
+/*       it exits                                                              */
+/*                                                                             */
+/*  While it serves a request, the pipes of the worker are those of the        */
+/*  request, i.e., request->child_in and request->child_out.  An idle worker   */
+/*  is not polled: it is noticed once it exits, see pool_reaped.  The stderr   */
+/*  of a worker is that of the daemon, as it is not tied to a request.         */
+/*                                                                             */
+/*  With config.plugin, a worker is a fork of the daemon that calls the        */
+/*  handler plugin instead of running the CGI program, see "fcgi-plugin.c".    */
+/*                                                                             */
+/*******************************************************************************/
+/* The loop protocol, on the stdin and stdout of the worker:                   */
+/*                                                                             */
+/*    chunk    = [length] "\n" [bytes]          the length, in decimal         */
+/*    request  = chunk                          the environment, i.e.,         */
+/*                                              "name=value" NUL, repeated     */
+/*               chunk* "0\n"                   the body, i.e., FCGI_STDIN     */
+/*    response = chunk* "0" [" " status] "\n"   the CGI output, and its exit   */
+/*                                              status (default 0)             */
+/*                                                                             */
+/*    - a worker reads the whole of a request, up to the end of its body,      */
+/*      before the next one                                                    */
+/*    - a worker exits once its stdin is closed                                */
+/*    - a worker that responds before its body has been sent, or that does     */
+/*      not follow the protocol, is replaced                                   */
+/*                                                                             */
+/*  See "temp/echo-request-worker.c" for a worker.                             */
+/*                                                                             */
+/*******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "fcgi-daemon.h"
+
+
+#define POOL_RESPAWN_DELAY   (1000)     // A worker that exits without serving a request
+#define POOL_FAILED_STATUS   (255)      // The appStatus of a request whose worker failed
+
+#define CHUNK_LENGTH    (0)             // Within the length of a chunk of the response
+#define CHUNK_CONTENT   (1)             // Within the content of a chunk
+
+
+static fcgi_worker * workers = NULL;    // config.pool_size slots
+static fcgi_worker * idle = NULL;       // The idle workers, most recently used first
+static fcgi_timer respawn_timer;
+static fcgi_timer admit_timer;
+
+static char * worker_env[] = { "FCGI_WORKER=1", NULL };
+
+
+static void admit_timeout(fcgi_timer * timer) {
+  responder_admit();
+}
+
+
+static void worker_idle(fcgi_worker * worker) {
+  worker->request = NULL;
+  worker->next_idle = idle;
+  idle = worker;
+
+  // The requests waiting for a worker are admitted after the current event
+  if (children_waiting != 0 && ! admit_timer.active) {
+    timer_start(&admit_timer, 0, admit_timeout, NULL);
+  }
+}
+
+
+static void unlink_idle(fcgi_worker * worker) {
+  fcgi_worker ** p;
+
+  for (p = &idle; *p != NULL; p = &(*p)->next_idle) {
+    if (*p == worker) { *p = worker->next_idle; break; }
+  }
+}
+
+
+
+/*******************************************************************************/
+/* Starting and retiring workers                                               */
+/*******************************************************************************/
+static int spawn_worker(fcgi_worker * worker) {
+  int pipe_to_worker[2];
+  int pipe_to_parent[2];
+  pid_t pid;
+
+  return_error(pipe2(pipe_to_worker, O_CLOEXEC) != 0, RETVAL_OTHER);
+  if (pipe2(pipe_to_parent, O_CLOEXEC) != 0) {
+    close(pipe_to_worker[0]); close(pipe_to_worker[1]);
+    return RETVAL_OTHER;
+  }
+
+  if (config.plugin) pid = plugin_fork(pipe_to_worker[0], pipe_to_parent[1]);
+  else pid = spawn_program(worker_env, pipe_to_worker[0], pipe_to_parent[1], -1, NULL, NULL);
+  close(pipe_to_worker[0]); close(pipe_to_parent[1]);
+
+  if (pid < 0) {
+    close(pipe_to_worker[1]); close(pipe_to_parent[0]);
+    stats_count(STATS_SPAWN_ERRORS, 1);
+    return RETVAL_OTHER;
+  }
+  stats_count(STATS_SPAWNS, 1);
+  children_running ++;
+
+  fcntl(pipe_to_worker[1], F_SETFL, O_NONBLOCK);
+  fcntl(pipe_to_parent[0], F_SETFL, O_NONBLOCK);
+
+  memset(worker, ZERO, sizeof(fcgi_worker));
+  worker->pid = pid;
+  worker->to_worker = pipe_to_worker[1];
+  worker->from_worker = pipe_to_parent[0];
+  worker_idle(worker);
+  return RETVAL_SUCCESS;
+}
+
+
+static void respawn_workers(fcgi_timer * timer) {
+  int i;
+
+  for (i = 0; i < config.pool_size; i++) {
+    if (workers[i].to_worker < 0 && spawn_worker(&workers[i]) != RETVAL_SUCCESS) {
+      timer_start(&respawn_timer, POOL_RESPAWN_DELAY, respawn_workers, NULL);
+    }
+  }
+}
+
+
+// The worker is replaced: it exits once its stdin is closed, or is terminated
+static void retire_worker(fcgi_worker * worker) {
+  int served = worker->requests;
+
+  close(worker->to_worker);
+  close(worker->from_worker);
+  if (worker->broken && worker->pid > 0) spawn_terminate(worker->pid);
+
+  // An exited worker is reaped, and then ignored, see pool_reaped
+  worker->to_worker = worker->from_worker = -1;
+  worker->pid = -1;
+
+  // A worker that fails at once, e.g., that can not be exec-ed, is respawned later
+  if (served == 0 || spawn_worker(worker) != RETVAL_SUCCESS) {
+    if (! respawn_timer.active) timer_start(&respawn_timer, POOL_RESPAWN_DELAY, respawn_workers, NULL);
+  }
+}
+
+
+int pool_init(void) {
+  int i;
+
+  workers = (fcgi_worker *) calloc(config.pool_size, sizeof(fcgi_worker));
+  return_error(workers == NULL, RETVAL_MEMORY_ERR);
+
+  for (i = 0; i < config.pool_size; i++) {
+    return_error(spawn_worker(&workers[i]) != RETVAL_SUCCESS, RETVAL_OTHER);
+  }
+  return RETVAL_SUCCESS;
+}
+
+
+// A child has exited: returns whether it was a worker
+int pool_reaped(pid_t pid) {
+  int i;
+
+  for (i = 0; i < config.pool_size; i++) {
+    if (workers[i].pid != pid) continue;
+
+    // The request of a busy worker ends at the end of its output, see pool_read
+    workers[i].pid = -1;
+    if (workers[i].request == NULL) {
+      unlink_idle(&workers[i]);
+      retire_worker(&workers[i]);
+    }
+    return NONZERO;
+  }
+  return ZERO;
+}
+
+
+
+/*******************************************************************************/
+/* Dispatching requests                                                        */
+/*******************************************************************************/
+int pool_idle(void) {
+  return idle != NULL;
+}
+
+
+fcgi_worker * pool_acquire(fcgi_request * request) {
+  fcgi_worker * worker = idle;
+
+  if (worker == NULL) return NULL;
+  idle = worker->next_idle;
+
+  worker->request = request;
+  worker->state = CHUNK_LENGTH;
+  worker->line_length = 0;
+  worker->ended = ZERO;
+  worker->status = 0;
+  return worker;
+}
+
+
+// The request is done with the worker, which is reused unless it has to be replaced
+void pool_release(fcgi_worker * worker) {
+  worker->requests ++;
+  if (! worker->ended) worker->broken = NONZERO;
+
+  if (worker->broken || worker->pid < 0
+      || (config.pool_max_requests != 0 && worker->requests >= config.pool_max_requests)) {
+    worker->request = NULL;
+    retire_worker(worker);
+  } else {
+    worker_idle(worker);
+  }
+}
+
+
+// Append a chunk of the request, or its end if "length" is 0
+int pool_frame(fcgi_buffer * buffer, const void * data, size_t length) {
+  char line[24];
+
+  return_error(buffer_append(buffer, line, snprintf(line, sizeof(line), "%zu\n", length)) != RETVAL_SUCCESS,
+               RETVAL_MEMORY_ERR);
+  return buffer_append(buffer, data, length);
+}
+
+
+// The line that ends the length of a chunk: "length", or "0 status" at the end
+static int chunk_line(fcgi_worker * worker) {
+  char * end;
+  long long length;
+
+  worker->line[worker->line_length] = '\0';
+  length = strtoll(worker->line, &end, 10);
+  return_error(end == worker->line || length < 0, RETVAL_PROTOCOL_ERROR);
+
+  if (length == 0) {
+    if (*end == ' ') worker->status = (int) strtol(end + 1, &end, 10);
+    return_error(*end != '\0', RETVAL_PROTOCOL_ERROR);
+    worker->ended = NONZERO;
+  } else {
+    return_error(*end != '\0', RETVAL_PROTOCOL_ERROR);
+    worker->remaining = (size_t) length;
+    worker->state = CHUNK_CONTENT;
+  }
+  worker->line_length = 0;
+  return RETVAL_SUCCESS;
+}
+
+
+/*******************************************************************************/
+/* Read the response of the worker, and append its content to "output"         */
+/*    - returns the count appended, or -1 if there is nothing to read yet,     */
+/*      e.g., only the length of a chunk, which was written apart from it      */
+/*    - worker->ended is set at the end of the response, or if the worker      */
+/*      fails: then the status is POOL_FAILED_STATUS                           */
+/*                                                                             */
+/*  The framing is removed in place: the content is moved over the lengths.    */
+/*******************************************************************************/
+ssize_t pool_read(fcgi_worker * worker, fcgi_buffer * output, size_t size) {
+  BYTE * data;
+  BYTE * p;
+  BYTE * end;
+  BYTE * q;
+  ssize_t count;
+  size_t length;
+  int failed = ZERO;
+
+  data = buffer_reserve(output, size);
+  if (data == NULL) return -1;
+
+  count = read(worker->from_worker, data, size);
+  if (count < 0 && (errno == EAGAIN || errno == EINTR)) return -1;
+  if (count <= 0) {
+    // The worker has exited, or closed its stdout, within the response
+    worker->broken = worker->ended = NONZERO;
+    worker->status = POOL_FAILED_STATUS;
+    return 0;
+  }
+
+  for (p = q = data, end = data + count; p < end && ! worker->ended && ! failed; ) {
+    if (worker->state == CHUNK_CONTENT) {
+      length = (size_t) (end - p) < worker->remaining ? (size_t) (end - p) : worker->remaining;
+      memmove(q, p, length);
+      p += length;
+      q += length;
+      worker->remaining -= length;
+      if (worker->remaining == 0) worker->state = CHUNK_LENGTH;
+    } else if (*p == '\n') {
+      p++;
+      failed = (chunk_line(worker) != RETVAL_SUCCESS);
+    } else if (worker->line_length < (int) sizeof(worker->line) - 1) {
+      worker->line[worker->line_length++] = *p++;
+    } else {
+      failed = NONZERO;
+    }
+  }
+
+  // A line that is not a length, or anything after the response
+  if (failed || p < end) {
+    worker->broken = worker->ended = NONZERO;
+    worker->status = POOL_FAILED_STATUS;
+  }
+
+  // Only framing: 0 would be taken for the end of the output
+  if (q == data && ! worker->ended) return -1;
+
+  buffer_commit(output, q - data);
+  return q - data;
+}
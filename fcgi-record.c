@@ -0,0 +1,133 @@
+/*******************************************************************************/
+/*  The FCGI record stream:                                                    */
+/*     - records are parsed from the input buffer of a connection, which is    */
+/*       filled with as few reads as possible, see receive_input               */
+/*     - the parser is resumable: a record that is not yet complete is         */
+/*       returned once the rest of it has been received                        */
+/*     - the content of selected types of records, e.g., FCGI_STDIN, is        */
+/*       returned in parts as it is received, rather than once it is complete  */
+/*                                                                             */
+/*  Usage:                                                                     */
+/*       while (record_next(&parser, &input, &record) == RETVAL_SUCCESS) {     */
+/*         ... process the record, or the part of its content                  */
+/*         record_done(&parser, &input);                                       */
+/*       }                                                                     */
+/*                                                                             */
+/*  A record, or part, that is not "done" is returned again by record_next,    */
+/*  e.g., once a stalled connection is resumed.                                */
+/*                                                                             */
+/*******************************************************************************/
+/* FCGI Protocol Definition: fcgi-spec.html                                    */
+/*                                                                             */
+/*    typedef struct {                                                         */
+/*        unsigned char version;                                               */
+/*        unsigned char type;                                                  */
+/*        unsigned char requestIdB1;                                           */
+/*        unsigned char requestIdB0;                                           */
+/*        unsigned char contentLengthB1;                                       */
+/*        unsigned char contentLengthB0;                                       */
+/*        unsigned char paddingLength;                                         */
+/*        unsigned char reserved;                                              */
+/*        unsigned char contentData[contentLength];                            */
+/*        unsigned char paddingData[paddingLength];                            */
+/*    } FCGI_Record;                                                           */
+/*                                                                             */
+/*******************************************************************************/
+
+#include "fcgi-daemon.h"
+
+
+// Skip the padding that has been received
+static void skip_padding(fcgi_record_parser * parser, fcgi_buffer * input) {
+  size_t count = buffer_length(input);
+
+  if (count > parser->padding) count = parser->padding;
+  buffer_consume(input, count);
+  parser->padding -= count;
+
+  if (parser->padding == 0) parser->state = RECORD_HEADER;
+}
+
+
+/*******************************************************************************/
+/* Return the next record, or the next part of the content of a record         */
+/*    - RETVAL_SUCCESS:         the record is returned                         */
+/*    - RETVAL_PARTIAL:         more input is needed                           */
+/*    - RETVAL_PROTOCOL_ERROR:  the input is not a stream of FCGI records      */
+/*******************************************************************************/
+int record_next(fcgi_record_parser * parser, fcgi_buffer * input, fcgi_record * record) {
+  const FCGI_Header * header;
+  size_t content_length;
+  size_t count;
+
+  parser->consume = 0;
+  if (parser->state == RECORD_PADDING) skip_padding(parser, input);
+
+  if (parser->state == RECORD_HEADER) {
+    if (buffer_length(input) < FCGI_HEADER_LEN) return RETVAL_PARTIAL;
+
+    header = (const FCGI_Header *) buffer_data(input);
+    return_error(header->version != FCGI_VERSION_1, RETVAL_PROTOCOL_ERROR);
+
+    content_length = (header->contentLengthB1 << 8) | header->contentLengthB0;
+    record->type = header->type;
+    record->request_id = (header->requestIdB1 << 8) | header->requestIdB0;
+
+    // The complete record
+    if (buffer_length(input) >= FCGI_HEADER_LEN + content_length + header->paddingLength) {
+      record->content = buffer_data(input) + FCGI_HEADER_LEN;
+      record->content_length = content_length;
+      record->part = ZERO;
+      parser->consume = FCGI_HEADER_LEN + content_length + header->paddingLength;
+      return RETVAL_SUCCESS;
+    }
+
+    // Otherwise, the content of the record may be returned in parts
+    if (content_length == 0 || record->type >= 32 || ! (parser->part_types & (1 << record->type))) {
+      return RETVAL_PARTIAL;
+    }
+    parser->type = record->type;
+    parser->request_id = record->request_id;
+    parser->remaining = content_length;
+    parser->padding = header->paddingLength;
+    parser->state = RECORD_CONTENT;
+    buffer_consume(input, FCGI_HEADER_LEN);
+    stats_count(STATS_RECORDS_IN, 1);
+  }
+
+  if (parser->state != RECORD_CONTENT) return RETVAL_PARTIAL;
+
+  count = buffer_length(input);
+  if (count > parser->remaining) count = parser->remaining;
+  if (count == 0) return RETVAL_PARTIAL;
+
+  record->type = parser->type;
+  record->request_id = parser->request_id;
+  record->content = buffer_data(input);
+  record->content_length = count;
+  record->part = NONZERO;
+  parser->consume = count;
+
+  return RETVAL_SUCCESS;
+}
+
+
+// The record, or part, returned by record_next has been processed
+void record_done(fcgi_record_parser * parser, fcgi_buffer * input) {
+  buffer_consume(input, parser->consume);
+  if (parser->state == RECORD_HEADER && parser->consume != 0) stats_count(STATS_RECORDS_IN, 1);
+
+  if (parser->state == RECORD_CONTENT) record_skip(parser, input, parser->consume);
+  parser->consume = 0;
+}
+
+
+// "count" bytes of the content have been processed, possibly without passing
+// through the input, e.g., when spliced
+void record_skip(fcgi_record_parser * parser, fcgi_buffer * input, size_t count) {
+  parser->remaining -= count;
+  if (parser->remaining != 0) return;
+
+  parser->state = RECORD_PADDING;
+  skip_padding(parser, input);
+}
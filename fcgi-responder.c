@@ -0,0 +1,1587 @@
+/*******************************************************************************/
+/*  The FCGI responder:                                                        */
+/*     - prepares an environmment containg CGI variables                       */
+/*     - exec-s the CGI program                                                */
+/*     - sends FCGI_STDIN to the child, and its output back to the client      */
+/*                                                                             */
+/*  The records of the request are received by the connection, see             */
+/*  "fcgi-connection.c".  Each request has its own child and pipes, which      */
+/*  are serviced by the event loop alongside all the other requests.           */
+/*                                                                             */
+/*  FCGI_STDIN and the child's stdout are pumped at the same time: the         */
+/*  response is sent while the request body is still being received.  Each     */
+/*  direction is bounded, see the "WATER" limits in "fcgi-daemon.h".           */
+/*                                                                             */
+/*  The responses to GET and HEAD requests may be cached, see "Response        */
+/*  cache" below: a cached response is sent without a child.                   */
+/*                                                                             */
+/*  With config.pool_size, a request is served by a persistent worker instead  */
+/*  of a child of its own, see "fcgi-pool.c": its pipes are those of the       */
+/*  worker, and its input and output are framed in chunks.                     */
+/*                                                                             */
+/*  With config.spool_memory, the body is received whole before the child is   */
+/*  started, and is its stdin, see "Spooling the body" below.                  */
+/*                                                                             */
+/*  With config.plugin, and without a pool, a request is served in-process by  */
+/*  the handler plugin instead of a child, once its body has been spooled,     */
+/*  see call_plugin below, and "fcgi-plugin.c".                                */
+/*                                                                             */
+/*  A request that ends before its child, e.g., on FCGI_ABORT_REQUEST, at      */
+/*  config.request_timeout, or when its connection closes, terminates the      */
+/*  child, see "Ending early" below.                                           */
+/*                                                                             */
+/*  An AUTHORIZER request runs the same CGI program, without a body, and its   */
+/*  decision may be cached, see "Authorizer" below.                            */
+/*                                                                             */
+/*******************************************************************************/
+/* FCGI Protocol Definition: fcgi-spec.html                                    */
+/*                                                                             */
+/* This is a limited implementation of the FCGI protocol.                      */
+/* The purpose of this implementation is for comparison to SCGI.               */
+/* As such, only the components that are related to this comparison            */
+/* have been implemented.                                                      */
+/*                                                                             */
+/* Specifically,                                                               */
+/*    - Appplication records limited to the following:                         */
+/*        o FCGI_BEGIN_REQUEST, FCGI_END_REQUEST                               */
+/*        o FCGI_PARAMS                                                        */
+/*        o FCGI_STDIN, FCGI_STDOUT, FCGI_STDERR                               */
+/*        o FCGI_ABORT_REQUEST                                                 */
+/*        o Note Implemented:                                                  */
+/*            - DATA                                                           */
+/*    - END_REQUEST limited to REQUEST_COMPLETE and UNKNOWN_ROLE               */
+/*    - RESPONDER and AUTHORIZER roles                                         */
+/*    - FILTER role NOT supported                                              */
+/*    - Strick adheres to the general communication flow                       */
+/*                                                                             */
+/*                                                                             */
+/* Many of the declarations in this implementation have been taken from the    */
+/*     FastCGI Specification, Mark R. Brown (see "fcgi-spec.html")             */
+/*                                                                             */
+/* We have tried to stay consist with the abstract C declaration and the       */
+/* overall layout of the specification, whenever poossible. As the spec.       */
+/* can be used as additional documentation for this implementation.            */
+/* and then adapted for our implementation.                                    */
+/*                                                                             */
+/*******************************************************************************/
+
+// Contraints that have not been implemented.
+
+// A Responder performing an update, e.g. implementing a POST method,
+// should compare the number of bytes received on FCGI_STDIN with
+// CONTENT_LENGTH and abort the update if the two numbers are not
+// equal.
+//
+// This is done for a spooled body only, see spool_end: a body that is
+// streamed has reached the child before its end.
+
+
+
+
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+
+#include "fcgi-daemon.h"
+
+
+#define MAX_STDOUT_BUFFER    (0xFFFF)
+#define STDERR_FINISH_READS  (16)     // See finish_stderr
+#define ABORTED_STATUS       (SIGTERM)  // The appStatus of a request that ends early
+#define SPOOL_CHUNK          (64 * 1024)  // A spooled body is sent to a worker in chunks
+
+#define child_stdin  pipe_to_child[0]
+#define to_child     pipe_to_child[1]
+#define from_child   pipe_to_parent[0]
+#define child_stdout pipe_to_parent[1]
+#define from_stderr  pipe_to_stderr[0]
+#define child_stderr pipe_to_stderr[1]
+
+
+static fcgi_request * children = NULL;   // The requests with a running child
+static fcgi_event child_signal;          // SIGCHLD, via a signalfd
+
+static fcgi_request * waiting = NULL;    // The requests waiting for a child, oldest first
+static fcgi_request * waiting_last = NULL;
+
+int children_running = 0;
+int children_waiting = 0;
+
+static fcgi_cache responses;             // See config.cache_size
+static fcgi_cache decisions;             // ... and config.auth_cache_size
+
+
+static void check_complete(fcgi_request * request);
+static void finish_stderr(fcgi_request * request);
+static void stop_caching(fcgi_request * request);
+static int  spawn_child(fcgi_request * request);
+static int  use_worker(fcgi_request * request);
+static int  call_plugin(fcgi_request * request);
+static void close_spool(fcgi_request * request);
+
+
+
+/*******************************************************************************/
+/* Closing the pipes to the child                                              */
+/*    - the pipes of a worker remain open, see release_worker                  */
+/*******************************************************************************/
+static void close_to_child(fcgi_request * request) {
+  int fd = request->child_in.fd;
+
+  buffer_free(&request->stdin_queue);
+  if (fd < 0) return;
+  event_remove(&request->child_in);
+  if (request->worker == NULL) close(fd);
+}
+
+
+static void close_from_child(fcgi_request * request) {
+  int fd = request->child_out.fd;
+
+  if (fd < 0) return;
+  event_remove(&request->child_out);
+  if (request->worker == NULL) close(fd);
+}
+
+
+static void close_stderr(fcgi_request * request) {
+  int fd = request->child_err.fd;
+
+  if (fd < 0) return;
+  event_remove(&request->child_err);
+  close(fd);
+}
+
+
+// The worker has responded, or the request has ended: the worker is returned
+// to the pool, see pool_release.  It is replaced if it has not received the
+// whole request.
+static void release_worker(fcgi_request * request) {
+  fcgi_worker * worker = request->worker;
+
+  if (! request->stdin_eof || request->child_in.fd >= 0) worker->broken = NONZERO;
+  close_to_child(request);
+  close_from_child(request);
+
+  request->worker = NULL;
+  request->exited = NONZERO;
+  request->status = worker->status;
+  pool_release(worker);
+}
+
+
+/*******************************************************************************/
+/* The CGI environment                                                         */
+/*    - the "name=value" strings are placed one after the other in an arena,   */
+/*      i.e., a single buffer, as the FCGI_PARAMS are received                 */
+/*    - the vector of pointers to the strings follows them, see env_vector     */
+/*    - the arenas are kept for reuse by later requests, with their memory     */
+/*******************************************************************************/
+#define ENV_POOL_SIZE   (16)
+
+static fcgi_buffer env_pool[ENV_POOL_SIZE];
+static int env_pool_count = 0;
+
+
+static void take_env(fcgi_request * request) {
+  if (request->env.data == NULL && env_pool_count != 0) request->env = env_pool[--env_pool_count];
+}
+
+
+static void free_env(fcgi_request * request) {
+  fcgi_buffer * env = &request->env;
+
+  buffer_free(&request->params);
+  request->env_count = 0;
+  if (env->data == NULL) return;
+
+  if (env_pool_count < ENV_POOL_SIZE) {
+    env->start = env->end = 0;
+    env_pool[env_pool_count++] = *env;
+    env->data = NULL;
+    env->size = 0;
+  } else {
+    buffer_free(env);
+  }
+}
+
+
+// The NULL terminated vector of the strings, placed after them in the arena
+static char ** env_vector(fcgi_request * request) {
+  fcgi_buffer * env = &request->env;
+  size_t offset = (env->end + sizeof(char *) - 1) & ~(sizeof(char *) - 1);
+  char ** vector;
+  char * p;
+  int i;
+
+  if (buffer_reserve(env, offset - env->end + (request->env_count + 1) * sizeof(char *)) == NULL) return NULL;
+
+  vector = (char **) (env->data + offset);
+  p = (char *) env->data;
+  for (i = 0; i < request->env_count; i++) {
+    vector[i] = p;
+    p += strlen(p) + 1;
+  }
+  vector[request->env_count] = NULL;
+
+  return vector;
+}
+
+
+static void unlink_child(fcgi_request * request) {
+  if (request->prev_child != NULL) request->prev_child->next_child = request->next_child;
+  else children = request->next_child;
+  if (request->next_child != NULL) request->next_child->prev_child = request->prev_child;
+}
+
+
+static void unlink_waiting(fcgi_request * request) {
+  if (request->prev_child != NULL) request->prev_child->next_child = request->next_child;
+  else waiting = request->next_child;
+  if (request->next_child != NULL) request->next_child->prev_child = request->prev_child;
+  else waiting_last = request->prev_child;
+
+  timer_stop(&request->wait_timer);
+  request->waiting = ZERO;
+  children_waiting --;
+}
+
+
+void responder_release(fcgi_request * request) {
+  if (request->waiting) unlink_waiting(request);
+  if (request->worker != NULL) release_worker(request);
+  close_to_child(request);
+  close_from_child(request);
+  close_stderr(request);
+  close_spool(request);
+  free_env(request);
+  timer_stop(&request->flush_timer);
+  timer_stop(&request->timeout_timer);
+  buffer_free(&request->stdout_pending);
+  stop_caching(request);
+
+  // The child is no longer of interest: it is terminated, then reaped and ignored
+  if (request->pid == 0) {
+    unlink_child(request);
+    spawn_cancel(request);
+  } else if (request->pid > 0 && ! request->exited) {
+    unlink_child(request);
+    spawn_terminate(request->pid);
+  }
+  request->pid = -1;
+}
+
+
+
+/*******************************************************************************/
+/* Admission control                                                           */
+/*    - at most config.max_children children run at the same time              */
+/*    - beyond that, up to config.max_waiting requests wait for a child to     */
+/*      exit, each for at most config.wait_timeout milliseconds                */
+/*    - otherwise, the request ends at once with FCGI_OVERLOADED, so that the  */
+/*      Web server may send it elsewhere                                       */
+/*    - a request whose child can not be started, e.g., out of descriptors     */
+/*      or processes, ends with FCGI_OVERLOADED as well                        */
+/*                                                                             */
+/*  The FCGI_STDIN of a waiting request is queued, up to STDIN_HIGH_WATER,     */
+/*  after which its connection stalls until the request is admitted or ends.   */
+/*                                                                             */
+/*  With config.pool_size, the limit is the idle workers instead.  A handler   */
+/*  plugin called in-process has no limit: it runs to completion at once.      */
+/*******************************************************************************/
+static int child_available(void) {
+  if (config.pool_size != 0) return pool_idle();
+  if (config.plugin) return NONZERO;
+  return config.max_children == 0 || children_running < config.max_children;
+}
+
+
+static int start_child(fcgi_request * request) {
+  if (config.pool_size != 0) return use_worker(request);
+  if (config.plugin) return call_plugin(request);
+  return spawn_child(request);
+}
+
+
+// A child that can not be started, e.g., on EMFILE, EAGAIN or a zygote that
+// does not answer: only its request fails, not the others on its connection
+static void start_failed(fcgi_request * request) {
+  stats_count(STATS_SPAWN_ERRORS, 1);
+  connection_end_request(request, ZERO, FCGI_OVERLOADED);
+}
+
+
+static void wait_timeout(fcgi_timer * timer) {
+  fcgi_request * request = (fcgi_request *) timer->data;
+
+  connection_end_request(request, ZERO, FCGI_OVERLOADED);
+}
+
+
+static int admit_child(fcgi_request * request) {
+  if (child_available()) {
+    if (start_child(request) != RETVAL_SUCCESS) start_failed(request);
+    return RETVAL_SUCCESS;
+  }
+
+  if (children_waiting >= config.max_waiting) {
+    connection_end_request(request, ZERO, FCGI_OVERLOADED);
+    return RETVAL_SUCCESS;
+  }
+
+  request->waiting = NONZERO;
+  request->next_child = NULL;
+  request->prev_child = waiting_last;
+  if (waiting_last != NULL) waiting_last->next_child = request;
+  else waiting = request;
+  waiting_last = request;
+  children_waiting ++;
+
+  timer_start(&request->wait_timer, config.wait_timeout, wait_timeout, request);
+  return RETVAL_SUCCESS;
+}
+
+
+// A child has exited, or a worker is idle: the oldest waiting request takes its place
+void responder_admit(void) {
+  fcgi_request * request;
+
+  while (waiting != NULL && child_available()) {
+    request = waiting;
+    unlink_waiting(request);
+    stats_since(STATS_WAIT, request->params_ended);
+
+    if (start_child(request) != RETVAL_SUCCESS) start_failed(request);
+  }
+}
+
+
+
+/*******************************************************************************/
+/*    - Wait:    Reap each of the child processes that have exited             */
+/*******************************************************************************/
+// A child has exited, with the "status" of waitpid(), see also fcgi-spawn.c
+void responder_exited(pid_t pid, int status) {
+  fcgi_request * request;
+
+  children_running --;
+  spawn_exited(pid);
+
+  for (request = children; request != NULL; request = request->next_child) {
+    if (request->pid == pid) break;
+  }
+  if (request == NULL) {
+    if (config.pool_size != 0) pool_reaped(pid);
+    return;
+  }
+
+  unlink_child(request);
+  stats_since(STATS_EXIT, request->spawned);
+  request->exited = NONZERO;
+  request->status = WIFEXITED(status) ? WEXITSTATUS(status) : status;
+  check_complete(request);
+}
+
+
+static void reap_children(fcgi_event * event, int ready) {
+  struct signalfd_siginfo info;
+  pid_t pid;
+  int status;
+
+  while (read(event->fd, &info, sizeof(info)) == sizeof(info)) ;
+
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    if (! spawn_reaped(pid)) responder_exited(pid, status);
+  }
+
+  responder_admit();
+}
+
+
+int responder_init(void) {
+  sigset_t mask;
+  int fd;
+
+  // SIGCHLD is received via the event loop
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  return_error(sigprocmask(SIG_BLOCK, &mask, NULL) != 0, RETVAL_OTHER);
+
+  // A child that exits without reading its stdin yields EPIPE
+  signal(SIGPIPE, SIG_IGN);
+
+  cache_init(&responses, config.cache_size);
+  cache_init(&decisions, config.auth_cache_size);
+
+  fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  return_error(fd < 0, RETVAL_OTHER);
+  return_error(event_add(&child_signal, fd, EVENT_READ, reap_children, NULL) != RETVAL_SUCCESS, RETVAL_OTHER);
+  event_edge(&child_signal);
+  return_error(spawn_init() != RETVAL_SUCCESS, RETVAL_OTHER);
+
+  if (config.pool_size != 0) return pool_init();
+  if (config.plugin) return plugin_init();
+  return RETVAL_SUCCESS;
+}
+
+
+
+/*******************************************************************************/
+/* Response cache                                                              */
+/*    - only GET and HEAD requests without a body are cached                   */
+/*    - the key is the REQUEST_METHOD, and the PARAMS listed in                */
+/*      config.cache_key: a variable that is absent differs from an empty one  */
+/*    - the FCGI_STDOUT of a child that exits with status 0 is stored, unless  */
+/*      it is larger than an eighth of the cache, or its headers forbid it,    */
+/*      see cache_response_ttl                                                 */
+/*                                                                             */
+/*  The output of a request that is captured is not spliced, see               */
+/*  stdout_handler.                                                            */
+/*******************************************************************************/
+#define CACHE_MAX_ENTRY   (config.cache_size / 8)
+
+
+// The value of a CGI variable within the arena, or NULL
+static const char * env_value(fcgi_request * request, const char * name, size_t name_length) {
+  const char * p = (const char *) request->env.data;
+  int i;
+
+  for (i = 0; i < request->env_count; i++) {
+    if (strncmp(p, name, name_length) == 0 && p[name_length] == '=') return p + name_length + 1;
+    p += strlen(p) + 1;
+  }
+  return NULL;
+}
+
+
+// The key of the PARAMS "names", separated by commas, is appended to the cache_key
+static int cache_key(fcgi_request * request, const char * names) {
+  fcgi_buffer * key = &request->cache_key;
+  const char * name;
+  const char * end;
+  const char * value;
+
+  for (name = names; *name != '\0'; name = (*end == ',') ? end + 1 : end) {
+    end = strchrnul(name, ',');
+    value = env_value(request, name, end - name);
+
+    // "name=value" or "name", each followed by a NUL
+    return_error(buffer_append(key, name, end - name) != RETVAL_SUCCESS, ZERO);
+    if (value != NULL) {
+      return_error(buffer_append(key, "=", 1) != RETVAL_SUCCESS, ZERO);
+      return_error(buffer_append(key, value, strlen(value)) != RETVAL_SUCCESS, ZERO);
+    }
+    return_error(buffer_append(key, "", 1) != RETVAL_SUCCESS, ZERO);
+  }
+  return NONZERO;
+}
+
+
+static int response_key(fcgi_request * request) {
+  const char * method = env_value(request, "REQUEST_METHOD", 14);
+  const char * length = env_value(request, "CONTENT_LENGTH", 14);
+
+  if (method == NULL || (strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0)) return ZERO;
+  if (length != NULL && atol(length) != 0) return ZERO;
+
+  return_error(buffer_append(&request->cache_key, method, strlen(method) + 1) != RETVAL_SUCCESS, ZERO);
+  return cache_key(request, config.cache_key);
+}
+
+
+static void stop_caching(fcgi_request * request) {
+  request->caching = ZERO;
+  buffer_free(&request->cache_key);
+  buffer_free(&request->cache_data);
+}
+
+
+// FCGI_STDOUT records of at most MAX_STDOUT_BUFFER each
+static void send_stdout(fcgi_request * request, const BYTE * data, size_t length) {
+  size_t count;
+
+  for (; length != 0; length -= count, data += count) {
+    count = (length > MAX_STDOUT_BUFFER) ? MAX_STDOUT_BUFFER : length;
+    connection_write_record(request->conn, FCGI_STDOUT, request->id, data, count);
+  }
+}
+
+
+// The response is that of the entry: the rest of the request, i.e., FCGI_STDIN, is ignored
+static void cache_send(fcgi_request * request, fcgi_cache_entry * entry) {
+  send_stdout(request, cache_entry_data(entry), entry->data_length);
+  connection_write_record(request->conn, FCGI_STDOUT, request->id, NULL, 0);
+  connection_end_request(request, entry->status, FCGI_REQUEST_COMPLETE);
+}
+
+
+// Send the cached response, if any; otherwise, capture the response of the child
+static int cache_replay(fcgi_request * request) {
+  fcgi_cache_entry * entry;
+
+  if (config.cache_size == 0) return ZERO;
+  if (! response_key(request)) {
+    stop_caching(request);
+    return ZERO;
+  }
+
+  entry = cache_lookup(&responses, buffer_data(&request->cache_key), buffer_length(&request->cache_key));
+  if (entry == NULL) {
+    stats_count(STATS_CACHE_MISSES, 1);
+    request->caching = NONZERO;
+    return ZERO;
+  }
+  stats_count(STATS_CACHE_HITS, 1);
+  cache_send(request, entry);
+  return NONZERO;
+}
+
+
+static void cache_capture(fcgi_request * request, const BYTE * content, size_t content_length) {
+  if (! request->caching) return;
+
+  if (buffer_length(&request->cache_data) + content_length > CACHE_MAX_ENTRY
+      || buffer_append(&request->cache_data, content, content_length) != RETVAL_SUCCESS) {
+    stop_caching(request);
+  }
+}
+
+
+static void cache_store(fcgi_request * request) {
+  fcgi_buffer * data = &request->cache_data;
+  long long ttl;
+
+  if (! request->caching || request->status != 0) return;
+
+  ttl = cache_response_ttl(buffer_data(data), buffer_length(data), config.cache_ttl * 1000LL);
+  if (ttl > 0) {
+    cache_insert(&responses, buffer_data(&request->cache_key), buffer_length(&request->cache_key),
+                 buffer_data(data), buffer_length(data), request->status, ttl);
+  }
+}
+
+
+
+/*******************************************************************************/
+/* Authorizer                                                                  */
+/*    - the CGI program runs with FCGI_ROLE=AUTHORIZER, and an empty stdin:    */
+/*      the FCGI_STDIN of the request, if any, is ignored                      */
+/*    - its output is held until it ends: a Status of 200, or none, allows     */
+/*      the access, and the response is then reduced to its Status and its     */
+/*      Variable-* headers, for the Web server ignores the rest; any other     */
+/*      response, i.e., a denial, is sent as is                                */
+/*    - an output beyond AUTHORIZER_MAX_HELD is not a decision: it is sent as  */
+/*      it comes                                                               */
+/*    - with config.auth_cache_size, a decision to allow is cached as it is    */
+/*      sent, keyed on the PARAMS listed in config.auth_key, and is fresh for  */
+/*      config.auth_ttl seconds, unless its headers say otherwise, see         */
+/*      cache_response_ttl                                                     */
+/*                                                                             */
+/*  Denials are not cached, so that an access is granted as soon as it is      */
+/*  allowed, but an access that is revoked remains allowed until it expires.   */
+/*******************************************************************************/
+#define AUTHORIZER_MAX_HELD  (64 * 1024)
+#define AUTH_MAX_ENTRY       (config.auth_cache_size / 8)
+#define ALLOWED_STATUS       "Status: 200 OK\r\n"
+
+#define is_header(h)   ((size_t) (colon - line) == strlen(h) && strncasecmp(line, h, colon - line) == 0)
+
+
+// The reduced response, if "response" allows the access, otherwise ZERO
+static int allowed_response(const BYTE * response, size_t length, fcgi_buffer * allowed) {
+  const char * line = (const char *) response;
+  const char * end = line + length;
+  const char * eol;
+  const char * colon;
+  const char * value;
+  size_t line_length;
+
+  return_error(buffer_append(allowed, ALLOWED_STATUS, strlen(ALLOWED_STATUS)) != RETVAL_SUCCESS, ZERO);
+  for (;;) {
+    eol = memchr(line, '\n', end - line);
+    if (eol == NULL) return ZERO;               // The headers are incomplete
+
+    // The blank line ends the headers
+    if (eol == line || (eol == line + 1 && line[0] == '\r')) break;
+    line_length = (eol[-1] == '\r') ? eol - 1 - line : eol - line;
+
+    colon = memchr(line, ':', eol - line);
+    if (colon != NULL) {
+      for (value = colon + 1; value < eol && (*value == ' ' || *value == '\t'); value++) ;
+
+      // A Location without a Status is a redirect
+      if (is_header("Status") && strncmp(value, "200", 3) != 0) return ZERO;
+      if (is_header("Location")) return ZERO;
+
+      if (colon - line > 9 && strncasecmp(line, "Variable-", 9) == 0) {
+        return_error(buffer_append(allowed, line, line_length) != RETVAL_SUCCESS, ZERO);
+        return_error(buffer_append(allowed, "\r\n", 2) != RETVAL_SUCCESS, ZERO);
+      }
+    }
+    line = eol + 1;
+  }
+  return buffer_append(allowed, "\r\n", 2) == RETVAL_SUCCESS;
+}
+
+
+// The output of the child so far: what is too long to be a decision is sent as it comes
+static void authorizer_hold(fcgi_request * request, const BYTE * content, size_t content_length) {
+  fcgi_buffer * held = &request->cache_data;
+
+  if (buffer_length(held) + content_length <= AUTHORIZER_MAX_HELD
+      && buffer_append(held, content, content_length) == RETVAL_SUCCESS) return;
+
+  request->authorizing = ZERO;
+  send_stdout(request, buffer_data(held), buffer_length(held));
+  send_stdout(request, content, content_length);
+  stop_caching(request);
+}
+
+
+// The output of the child has ended: the decision is sent, and cached
+static void authorizer_respond(fcgi_request * request) {
+  fcgi_buffer * held = &request->cache_data;
+  fcgi_buffer allowed = { NULL, 0, 0, 0 };
+  long long ttl;
+
+  request->authorizing = ZERO;
+  if (! allowed_response(buffer_data(held), buffer_length(held), &allowed)) {
+    stats_count(STATS_AUTH_DENIED, 1);
+    send_stdout(request, buffer_data(held), buffer_length(held));
+    buffer_free(&allowed);
+    stop_caching(request);
+    return;
+  }
+
+  stats_count(STATS_AUTH_ALLOWED, 1);
+  send_stdout(request, buffer_data(&allowed), buffer_length(&allowed));
+
+  if (request->caching && buffer_length(&allowed) <= AUTH_MAX_ENTRY) {
+    ttl = cache_response_ttl(buffer_data(held), buffer_length(held), config.auth_ttl * 1000LL);
+    if (ttl > 0) {
+      cache_insert(&decisions, buffer_data(&request->cache_key), buffer_length(&request->cache_key),
+                   buffer_data(&allowed), buffer_length(&allowed), ZERO, ttl);
+    }
+  }
+  buffer_free(&allowed);
+  stop_caching(request);
+}
+
+
+// The end of PARAMS: the cached decision, if any, otherwise that of the child
+static int authorizer_start(fcgi_request * request) {
+  fcgi_cache_entry * entry;
+
+  if (config.auth_cache_size != 0 && cache_key(request, config.auth_key)) {
+    entry = cache_lookup(&decisions, buffer_data(&request->cache_key), buffer_length(&request->cache_key));
+    if (entry != NULL) {
+      stats_count(STATS_AUTH_HITS, 1);
+      cache_send(request, entry);
+      return RETVAL_SUCCESS;
+    }
+    stats_count(STATS_AUTH_MISSES, 1);
+    request->caching = NONZERO;
+  }
+
+  return_error(responder_env(request, (const BYTE *) "FCGI_ROLE", 9, (const BYTE *) "AUTHORIZER", 10)
+               != RETVAL_SUCCESS, RETVAL_MEMORY_ERR);
+
+  // The body is empty, i.e., a worker is sent its end at once, see pool_frame
+  request->stdin_eof = NONZERO;
+  if (config.pool_size != 0) {
+    return_error(pool_frame(&request->stdin_queue, NULL, 0) != RETVAL_SUCCESS, RETVAL_MEMORY_ERR);
+  }
+  request->authorizing = NONZERO;
+  return admit_child(request);
+}
+
+
+
+/*******************************************************************************/
+/*    - Send:    {FCGI_END_REQUEST, id, {status, FCGI_REQUEST_COMPLETE}         */
+/*******************************************************************************/
+static void check_complete(fcgi_request * request) {
+  if (request->exited && request->stdout_eof) {
+    finish_stderr(request);
+    cache_store(request);
+    connection_end_request(request, request->status, FCGI_REQUEST_COMPLETE);
+  }
+}
+
+
+
+/*******************************************************************************/
+/*    - Receive: STDOUT from child process                                     */
+/*    - Send:    {FCGI_STDOUT, id, <string> }+                                 */
+/*                                                                             */
+/*  The output is coalesced: what a child writes in small pieces, e.g., line   */
+/*  by line, is pending until config.output_size bytes are available, or      */
+/*  config.flush_delay milliseconds have passed.                               */
+/*******************************************************************************/
+static void flush_stdout(fcgi_request * request) {
+  fcgi_buffer * pending = &request->stdout_pending;
+
+  timer_stop(&request->flush_timer);
+  if (buffer_length(pending) == 0) return;
+
+  if (request->authorizing) {
+    authorizer_hold(request, buffer_data(pending), buffer_length(pending));
+  } else {
+    cache_capture(request, buffer_data(pending), buffer_length(pending));
+    connection_write_record(request->conn, FCGI_STDOUT, request->id,
+                            buffer_data(pending), buffer_length(pending));
+  }
+  buffer_consume(pending, buffer_length(pending));
+}
+
+
+static void flush_timeout(fcgi_timer * timer) {
+  flush_stdout((fcgi_request *) timer->data);
+}
+
+
+static void stdout_handler(fcgi_event * event, int ready) {
+  fcgi_request * request = (fcgi_request * ) event->data;
+  fcgi_connection * conn = request->conn;
+  fcgi_buffer * pending = &request->stdout_pending;
+  BYTE * buffer_content;
+  ssize_t content_length;
+  int available;
+
+  // Backpressure: the connection resumes the read, see responder_resume_output
+  if (conn->output_full || conn->splice_request == request) {
+    event_modify(&request->child_out, ZERO);
+    return;
+  }
+
+  if (! request->output_seen) {
+    request->output_seen = NONZERO;
+    stats_since(STATS_FIRST_OUTPUT, request->spawned);
+  }
+
+  // Zero-copy: a full record is spliced by the connection, once it has been
+  // sent up to this record.  The rest of the output is read, as usual.
+  if (conn->splice_out && conn->splice_request == NULL && buffer_length(pending) == 0 && ! request->caching
+      && ! request->authorizing && request->worker == NULL && ioctl(event->fd, FIONREAD, &available) == 0 && available >= config.output_size) {
+    if (available > MAX_STDOUT_BUFFER) available = MAX_STDOUT_BUFFER;
+
+    event_modify(&request->child_out, ZERO);
+    connection_splice_record(conn, request, available);
+    stats_count(STATS_STDOUT_BYTES, available);
+    return;
+  }
+
+  if (request->worker != NULL) {
+    // The output of a worker is framed: it is read into the pending output
+    content_length = pool_read(request->worker, pending, MAX_STDOUT_BUFFER - buffer_length(pending));
+    if (content_length < 0) return;
+  } else if (buffer_length(pending) == 0 && ! request->authorizing) {
+    // Read directly into a record, which is kept pending only if it is small
+    buffer_content = connection_reserve_record(conn, MAX_STDOUT_BUFFER);
+    if (buffer_content == NULL) return;
+
+    content_length = read(event->fd, buffer_content, MAX_STDOUT_BUFFER);
+    if (content_length < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (content_length < 0) content_length = 0;
+
+    if (content_length >= config.output_size
+        || (content_length != 0 && buffer_append(pending, buffer_content, content_length) != RETVAL_SUCCESS)) {
+      cache_capture(request, buffer_content, content_length);
+      connection_commit_record(conn, FCGI_STDOUT, request->id, content_length);
+      return;
+    }
+  } else {
+    buffer_content = buffer_reserve(pending, MAX_STDOUT_BUFFER - buffer_length(pending));
+    if (buffer_content == NULL) return;
+
+    content_length = read(event->fd, buffer_content, MAX_STDOUT_BUFFER - buffer_length(pending));
+    if (content_length < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (content_length < 0) content_length = 0;
+    buffer_commit(pending, content_length);
+  }
+
+  stats_count(STATS_STDOUT_BYTES, content_length);
+
+  if (content_length == 0 || (request->worker != NULL && request->worker->ended)) {
+    // All output from the child has been processed.
+    // A record of the form {FCGI_STDOUT, id, ""} denotes end of 'stdout'
+    flush_stdout(request);
+    if (request->authorizing) authorizer_respond(request);
+    connection_write_record(conn, FCGI_STDOUT, request->id, NULL, 0);
+
+    close_from_child(request);
+    stats_since(STATS_STDOUT, request->spawned);
+    request->stdout_eof = NONZERO;
+    if (request->worker != NULL) release_worker(request);
+    check_complete(request);
+    return;
+  }
+
+  if (buffer_length(pending) >= (size_t) config.output_size || buffer_length(pending) == MAX_STDOUT_BUFFER) {
+    flush_stdout(request);
+  } else if (! request->flush_timer.active) {
+    timer_start(&request->flush_timer, config.flush_delay, flush_timeout, request);
+  }
+}
+
+
+
+/*******************************************************************************/
+/*    - Receive: STDERR from child process                                     */
+/*    - Send:    {FCGI_STDERR, id, <string> }*, then {FCGI_STDERR, id, ""}     */
+/*                                                                             */
+/*  At most config.stderr_limit bytes are sent per request: the rest is read   */
+/*  and dropped, so that a verbose child does not stall on its stderr.  While  */
+/*  the connection is above OUTPUT_HIGH_WATER, stderr is paused, as stdout is, */
+/*  or with config.stderr_drop, dropped.                                       */
+/*******************************************************************************/
+// Returns the count read, 0 at the end of stderr, or -1 if there is nothing to read
+static ssize_t read_stderr(fcgi_request * request, int drop) {
+  static BYTE discard[MAX_STDOUT_BUFFER];
+  fcgi_connection * conn = request->conn;
+  size_t room = MAX_STDOUT_BUFFER;
+  BYTE * content = NULL;
+  ssize_t count;
+
+  if (config.stderr_limit != 0 && request->stderr_sent + room > config.stderr_limit) {
+    room = config.stderr_limit - request->stderr_sent;
+  }
+  if (! drop && room != 0) content = connection_reserve_record(conn, room);
+  if (content == NULL) {
+    content = discard;
+    room = sizeof(discard);
+  }
+
+  count = read(request->child_err.fd, content, room);
+  if (count < 0) return (errno == EAGAIN || errno == EINTR) ? -1 : 0;
+
+  if (count == 0) return 0;
+  if (content == discard) {
+    stats_count(STATS_STDERR_DROPPED, count);
+  } else {
+    connection_commit_record(conn, FCGI_STDERR, request->id, count);
+    request->stderr_sent += count;
+    stats_count(STATS_STDERR_BYTES, count);
+  }
+  return count;
+}
+
+
+static void end_stderr(fcgi_request * request) {
+  close_stderr(request);
+  if (request->stderr_sent != 0) connection_write_record(request->conn, FCGI_STDERR, request->id, NULL, 0);
+}
+
+
+static void stderr_handler(fcgi_event * event, int ready) {
+  fcgi_request * request = (fcgi_request * ) event->data;
+
+  // Backpressure, as for stdout, see responder_resume_output
+  if (request->conn->output_full && ! config.stderr_drop) {
+    event_modify(&request->child_err, ZERO);
+    return;
+  }
+
+  if (read_stderr(request, request->conn->output_full) == 0) end_stderr(request);
+}
+
+
+// The child has exited: what remains in the pipe is sent before FCGI_END_REQUEST,
+// without waiting on a process that might have inherited the pipe
+static void finish_stderr(fcgi_request * request) {
+  int reads;
+
+  if (request->child_err.fd < 0) return;
+  for (reads = 0; reads < STDERR_FINISH_READS && read_stderr(request, ZERO) > 0; reads++) ;
+  end_stderr(request);
+}
+
+
+
+/*******************************************************************************/
+/* Ending early                                                                */
+/*    - Receive: {FCGI_ABORT_REQUEST, id, ""}                                  */
+/*    - Send:    {FCGI_END_REQUEST, id, {ABORTED_STATUS, REQUEST_COMPLETE}}    */
+/*                                                                             */
+/*  The request ends at once, rather than when its child exits: the child is   */
+/*  terminated, see responder_release, and a worker is replaced.  The output   */
+/*  of the child so far is sent, and its streams are ended.                    */
+/*                                                                             */
+/*  Note: an ABORT_REQUEST that follows a stalled record is received once the  */
+/*  connection resumes, e.g., at config.request_timeout.                       */
+/*******************************************************************************/
+static void end_early(fcgi_request * request) {
+  if (request->pid >= 0 || request->worker != NULL) {
+    flush_stdout(request);
+    if (! request->stdout_eof) connection_write_record(request->conn, FCGI_STDOUT, request->id, NULL, 0);
+    end_stderr(request);
+  }
+  connection_end_request(request, ABORTED_STATUS, FCGI_REQUEST_COMPLETE);
+}
+
+
+int responder_abort(fcgi_request * request) {
+  stats_count(STATS_ABORTED, 1);
+  end_early(request);
+  return RETVAL_SUCCESS;
+}
+
+
+static void request_timeout(fcgi_timer * timer) {
+  stats_count(STATS_TIMED_OUT, 1);
+  end_early((fcgi_request *) timer->data);
+}
+
+
+
+/*******************************************************************************/
+/* Spooling the body, see config.spool_memory                                  */
+/*    - FCGI_STDIN is received whole before the child is admitted, so that     */
+/*      neither the connection nor the child waits on the other                */
+/*    - it is written to a memfd, then, once it exceeds config.spool_memory,   */
+/*      to an unnamed temporary file in $TMPDIR, i.e., O_TMPFILE               */
+/*    - its length is checked against CONTENT_LENGTH, and becomes the          */
+/*      CONTENT_LENGTH if there is none                                        */
+/*    - the spool, at offset 0, is the stdin of the child: a regular file,     */
+/*      which it may seek, or mmap.  A memfd is sealed beforehand; a file may  */
+/*      not be sealed, so it is made read-only instead, and reopened           */
+/*      O_RDONLY via /proc/self/fd, see spool_read_only: the child can not     */
+/*      write it, nor reopen it for writing, unless it runs as root            */
+/*                                                                             */
+/*  A worker is sent the spool in chunks, as its pipe drains, see refill_stdin.*/
+/*******************************************************************************/
+#define BAD_LENGTH_RESPONSE   "Status: 400 Bad Request\r\nContent-Type: text/plain\r\n\r\n" \
+                              "The body does not match its CONTENT_LENGTH.\r\n"
+#define SPOOL_ERROR_RESPONSE  "Status: 500 Internal Server Error\r\nContent-Type: text/plain\r\n\r\n" \
+                              "The body can not be spooled.\r\n"
+
+
+static void close_spool(fcgi_request * request) {
+  if (request->spool_fd < 0) return;
+  close(request->spool_fd);
+  request->spool_fd = -1;
+}
+
+
+// The request ends without a child, e.g., as its body does not match CONTENT_LENGTH
+static void reject_body(fcgi_request * request, const char * response) {
+  connection_write_record(request->conn, FCGI_STDOUT, request->id, (const BYTE *) response, strlen(response));
+  connection_write_record(request->conn, FCGI_STDOUT, request->id, NULL, 0);
+  connection_end_request(request, ZERO, FCGI_REQUEST_COMPLETE);
+}
+
+
+// The memfd is copied to a temporary file, which replaces it
+static int spool_to_file(fcgi_request * request) {
+  const char * dir = getenv("TMPDIR");
+  off_t offset = 0;
+  ssize_t count;
+  int fd;
+
+  fd = open((dir != NULL && *dir != '\0') ? dir : "/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  return_error(fd < 0, RETVAL_OTHER);
+
+  while ((size_t) offset < request->spool_length) {
+    count = sendfile(fd, request->spool_fd, &offset, request->spool_length - offset);
+    if (count <= 0) {
+      close(fd);
+      return RETVAL_OTHER;
+    }
+  }
+
+  close(request->spool_fd);
+  request->spool_fd = fd;
+  request->spool_file = NONZERO;
+  stats_count(STATS_SPOOL_FILES, 1);
+  return RETVAL_SUCCESS;
+}
+
+
+static int spool_write(fcgi_request * request, const BYTE * content, size_t length) {
+  ssize_t count;
+
+  if (request->spool_fd < 0) {
+    request->spool_fd = memfd_create("fcgi-stdin", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    return_error(request->spool_fd < 0, RETVAL_OTHER);
+  }
+  if (! request->spool_file && request->spool_length + length > config.spool_memory) {
+    return_error(spool_to_file(request) != RETVAL_SUCCESS, RETVAL_OTHER);
+  }
+
+  while (length != 0) {
+    count = write(request->spool_fd, content, length);
+    if (count < 0 && errno == EINTR) continue;
+    return_error(count <= 0, RETVAL_OTHER);
+
+    content += count;
+    length -= count;
+    request->spool_length += count;
+    stats_count(STATS_SPOOL_BYTES, count);
+  }
+  return RETVAL_SUCCESS;
+}
+
+
+// A part of the body, i.e., a FCGI_STDIN record
+static void spool_stdin(fcgi_request * request, const BYTE * content, int content_length) {
+  if (request->content_length >= 0 && request->spool_length + content_length > (size_t) request->content_length) {
+    stats_count(STATS_BAD_LENGTH, 1);
+    reject_body(request, BAD_LENGTH_RESPONSE);
+    return;
+  }
+  if (spool_write(request, content, content_length) != RETVAL_SUCCESS) reject_body(request, SPOOL_ERROR_RESPONSE);
+}
+
+
+// The temporary file is replaced by a read-only descriptor of it
+static int spool_read_only(fcgi_request * request) {
+  char path[32];
+  int fd;
+
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", request->spool_fd);
+  return_error(fchmod(request->spool_fd, 0400) != 0, RETVAL_OTHER);
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  return_error(fd < 0, RETVAL_OTHER);
+
+  close(request->spool_fd);
+  request->spool_fd = fd;
+  return RETVAL_SUCCESS;
+}
+
+
+// The whole body has been received: the child is admitted
+static int spool_end(fcgi_request * request) {
+  char length[24];
+
+  if (request->content_length < 0 && request->spool_length != 0) {
+    snprintf(length, sizeof(length), "%zu", request->spool_length);
+    return_error(responder_env(request, (const BYTE *) "CONTENT_LENGTH", 14, (const BYTE *) length,
+                               strlen(length)) != RETVAL_SUCCESS, RETVAL_MEMORY_ERR);
+  } else if (request->content_length >= 0 && request->spool_length != (size_t) request->content_length) {
+    stats_count(STATS_BAD_LENGTH, 1);
+    reject_body(request, BAD_LENGTH_RESPONSE);
+    return RETVAL_SUCCESS;
+  }
+
+  // An empty body is an empty spool, i.e., the child reads EOF at once
+  if (spool_write(request, NULL, 0) != RETVAL_SUCCESS) {
+    reject_body(request, SPOOL_ERROR_RESPONSE);
+    return RETVAL_SUCCESS;
+  }
+  if (! request->spool_file) {
+    fcntl(request->spool_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+  } else if (spool_read_only(request) != RETVAL_SUCCESS) {
+    reject_body(request, SPOOL_ERROR_RESPONSE);
+    return RETVAL_SUCCESS;
+  }
+  lseek(request->spool_fd, 0, SEEK_SET);
+
+  return admit_child(request);
+}
+
+
+// A worker has drained its pipe: the next chunk of the spool, or the end of the body
+static int refill_stdin(fcgi_request * request) {
+  static BYTE chunk[SPOOL_CHUNK];
+  ssize_t count;
+
+  if (request->spool_fd < 0 || request->worker == NULL) return ZERO;
+
+  count = read(request->spool_fd, chunk, sizeof(chunk));
+  if (count <= 0) {
+    count = 0;
+    close_spool(request);
+  }
+  return pool_frame(&request->stdin_queue, chunk, count) == RETVAL_SUCCESS;
+}
+
+
+
+/*******************************************************************************/
+/*    - Send: <string> + to child process                                      */
+/*******************************************************************************/
+static void stdin_handler(fcgi_event * event, int ready) {
+  fcgi_request * request = (fcgi_request * ) event->data;
+  fcgi_buffer * queue = &request->stdin_queue;
+  ssize_t count;
+
+  while (buffer_length(queue) != 0 || refill_stdin(request)) {
+    count = write(event->fd, buffer_data(queue), buffer_length(queue));
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) return;
+
+      // The child, if it ignores stdin, might have exited: discard the rest
+      if (request->worker != NULL) request->worker->broken = NONZERO;
+      close_to_child(request);
+      break;
+    }
+    buffer_consume(queue, count);
+  }
+
+  if (request->child_in.fd >= 0) {
+    if (request->stdin_eof) close_to_child(request);
+    else event_modify(&request->child_in, ZERO);
+  }
+
+  // The connection may have stalled on this child's input
+  connection_resume(request->conn);
+}
+
+
+void responder_resume_output(fcgi_request * request) {
+  if (request->child_out.fd >= 0) event_modify(&request->child_out, EVENT_READ);
+  if (request->child_err.fd >= 0) event_modify(&request->child_err, EVENT_READ);
+}
+
+
+// Splice the output of the child that is already in the pipe, see stdout_handler
+ssize_t responder_splice_stdout(fcgi_request * request, int fd, size_t length, int more) {
+  return splice(request->child_out.fd, NULL, fd, NULL, length,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (more ? SPLICE_F_MORE : ZERO));
+}
+
+
+/*******************************************************************************/
+/*    - Splice: {FCGI_STDIN, id, <string> } from the connection to the child  */
+/*                                                                             */
+/*  Returns the count, or -1 and errno, as per splice(), and errno:            */
+/*    - EBUSY:  the pipe is full; stdin_handler resumes the connection         */
+/*    - EINVAL: the content is to be read instead, e.g., to be queued           */
+/*******************************************************************************/
+ssize_t responder_splice_stdin(fcgi_request * request, int fd, size_t length) {
+  struct pollfd pipe_poll;
+  ssize_t count;
+
+  if (request->child_in.fd < 0 || buffer_length(&request->stdin_queue) != 0 || config.pool_size != 0
+      || config.spool_memory != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  count = splice(fd, NULL, request->child_in.fd, NULL, length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (count > 0) stats_count(STATS_STDIN_BYTES, count);
+  if (count >= 0 || errno != EAGAIN) {
+    if (count < 0 && errno == EPIPE) {
+      // The child no longer reads its stdin
+      close_to_child(request);
+      errno = EINVAL;
+    }
+    return count;
+  }
+
+  // Either the connection has no input, or the pipe is full
+  pipe_poll.fd = request->child_in.fd;
+  pipe_poll.events = POLLOUT;
+  if (poll(&pipe_poll, 1, 0) == 0) {
+    event_modify(&request->child_in, EVENT_WRITE);
+    errno = EBUSY;
+  }
+  return -1;
+}
+
+
+/*******************************************************************************/
+/*    - Receive: {FCGI_STDIN, id, <string> }+                                  */
+/*******************************************************************************/
+int responder_stdin(fcgi_request * request, const BYTE * content, int content_length) {
+  fcgi_buffer * queue = &request->stdin_queue;
+  ssize_t count;
+
+  // The stdin of an authorizer is empty, see authorizer_start
+  if (request->role == FCGI_AUTHORIZER) {
+    if (content_length == 0) request->state = REQUEST_RUNNING;
+    return RETVAL_SUCCESS;
+  }
+
+  /* A record of the form {FCGI_STDIN, id, ""} denotes end of 'stdin' */
+  if (content_length == 0) {
+    stats_since(STATS_STDIN, request->params_ended);
+    request->stdin_eof = NONZERO;
+    request->state = REQUEST_RUNNING;
+
+    if (config.spool_memory != 0) return spool_end(request);
+
+    // The end of the body is a chunk of its own for a worker, see pool_frame
+    if (config.pool_size != 0 && (request->waiting || request->child_in.fd >= 0)) {
+      return_error(pool_frame(queue, NULL, 0) != RETVAL_SUCCESS, RETVAL_MEMORY_ERR);
+      if (! request->waiting) event_modify(&request->child_in, EVENT_WRITE);
+    } else if (buffer_length(queue) == 0) {
+      close_to_child(request);
+    }
+    return RETVAL_SUCCESS;
+  }
+
+  // The body is spooled, see spool_stdin
+  if (config.spool_memory != 0) {
+    stats_count(STATS_STDIN_BYTES, content_length);
+    spool_stdin(request, content, content_length);
+    return RETVAL_SUCCESS;
+  }
+
+  // The child no longer reads its stdin
+  if (request->child_in.fd < 0 && ! request->waiting) return RETVAL_SUCCESS;
+
+  // Backpressure: the record waits until the child has read its input
+  if (buffer_length(queue) >= STDIN_HIGH_WATER) return RETVAL_STALLED;
+  stats_count(STATS_STDIN_BYTES, content_length);
+
+  // The body is sent to a worker in chunks, via the queue
+  if (config.pool_size != 0) {
+    return_error(pool_frame(queue, content, content_length) != RETVAL_SUCCESS, RETVAL_MEMORY_ERR);
+    if (! request->waiting) event_modify(&request->child_in, EVENT_WRITE);
+    return RETVAL_SUCCESS;
+  }
+
+  // Write directly to the child, and queue whatever does not fit in the pipe
+  if (buffer_length(queue) == 0 && ! request->waiting) {
+    count = write(request->child_in.fd, content, content_length);
+    if (count < 0 && errno != EAGAIN && errno != EINTR) {
+      close_to_child(request);
+      return RETVAL_SUCCESS;
+    }
+    if (count > 0) {
+      content += count;
+      content_length -= count;
+    }
+  }
+  if (content_length != 0) {
+    return_error(buffer_append(queue, content, content_length) != RETVAL_SUCCESS, RETVAL_MEMORY_ERR);
+    if (! request->waiting) event_modify(&request->child_in, EVENT_WRITE);
+  }
+  return RETVAL_SUCCESS;
+}
+
+
+
+/*******************************************************************************/
+/*    - Spawn: a child process to execute the CGI program, see fcgi-spawn.c    */
+/*******************************************************************************/
+
+// The child can not be spawned: as if it had exited at once, e.g., when the
+// program can not be executed, unless the failure is transient, e.g., EAGAIN
+static int spawn_failed(fcgi_request * request, int error) {
+  return_error(error == EAGAIN || error == ENOMEM, RETVAL_OTHER);
+  stats_count(STATS_SPAWN_ERRORS, 1);
+
+  connection_write_record(request->conn, FCGI_STDOUT, request->id, NULL, 0);
+  connection_end_request(request, RETVAL_UNABLE_TO_EXEC, FCGI_REQUEST_COMPLETE);
+  return RETVAL_SUCCESS;
+}
+
+
+// The child has been spawned, at once or on the reply of the zygote.  The
+// child of a request that has since ended, i.e., "data" is NULL, is terminated.
+static void child_spawned(void * data, pid_t pid, int error) {
+  fcgi_request * request = (fcgi_request *) data;
+
+  if (request == NULL) {
+    if (pid > 0) spawn_terminate(pid);
+    else children_running --;
+    return;
+  }
+
+  if (pid < 0) {
+    children_running --;
+    unlink_child(request);
+    request->pid = -1;
+    if (spawn_failed(request, error) != RETVAL_SUCCESS) start_failed(request);
+    return;
+  }
+
+  stats_record(STATS_SPAWN, stats_now() - request->spawned);
+  stats_count(STATS_SPAWNS, 1);
+  request->spawned = stats_now();
+  request->pid = pid;
+}
+
+
+static int spawn_child(fcgi_request * request) {
+  int pipe_to_child[2] = { -1, -1 };  // child(0) <-- parent, or the spool
+  int pipe_to_parent[2];  // parent <-- child(1)
+  int pipe_to_stderr[2] = { -1, -1 };  // parent <-- child(2), FCGI only
+  pid_t child_pid;
+  char ** env;
+
+  env = env_vector(request);
+  return_error(env == NULL, RETVAL_MEMORY_ERR);
+
+  // Create the pipes for communcation with the child.  A spooled body is
+  // the stdin of the child instead, and is closed along with the pipes.
+  if (request->spool_fd >= 0) {
+    child_stdin = request->spool_fd;
+    request->spool_fd = -1;
+  } else {
+    return_error(pipe2(pipe_to_child, O_CLOEXEC) != 0, RETVAL_OTHER);
+  }
+  if (pipe2(pipe_to_parent, O_CLOEXEC) != 0) {
+    close(child_stdin);
+    if (to_child >= 0) close(to_child);
+    return RETVAL_OTHER;
+  }
+
+  // SCGI has no stream for stderr: the child keeps that of the daemon
+  if (request->conn->protocol == PROTOCOL_FCGI && pipe2(pipe_to_stderr, O_CLOEXEC) != 0) {
+    close(child_stdin);
+    if (to_child >= 0) close(to_child);
+    close(from_child); close(child_stdout);
+    return RETVAL_OTHER;
+  }
+
+  // With the zygote, the pid is 0 until it replies, see child_spawned
+  request->spawned = stats_now();
+  child_pid = spawn_program(env, child_stdin, child_stdout, child_stderr, child_spawned, request);
+  close(child_stdin); close(child_stdout);
+  if (child_stderr >= 0) close(child_stderr);
+  free_env(request);
+
+  if (child_pid < 0) {
+    int error = errno;
+
+    if (to_child >= 0) close(to_child);
+    close(from_child);
+    if (from_stderr >= 0) close(from_stderr);
+    return spawn_failed(request, error);
+  }
+
+  children_running ++;
+  request->pid = child_pid;
+  request->prev_child = NULL;
+  request->next_child = children;
+  if (children != NULL) children->prev_child = request;
+  children = request;
+  if (child_pid > 0) child_spawned(request, child_pid, 0);
+
+  if (to_child >= 0) {
+    fcntl(to_child, F_SETFL, O_NONBLOCK);
+    event_add(&request->child_in, to_child, ZERO, stdin_handler, request);
+  }
+  fcntl(from_child, F_SETFL, O_NONBLOCK);
+  event_add(&request->child_out, from_child, EVENT_READ, stdout_handler, request);
+  if (from_stderr >= 0) {
+    fcntl(from_stderr, F_SETFL, O_NONBLOCK);
+    event_add(&request->child_err, from_stderr, EVENT_READ, stderr_handler, request);
+  }
+
+  // FCGI_STDIN that arrived while the request was waiting
+  if (buffer_length(&request->stdin_queue) != 0) event_modify(&request->child_in, EVENT_WRITE);
+  else if (request->stdin_eof) close_to_child(request);
+
+  return RETVAL_SUCCESS;
+}
+
+
+/*******************************************************************************/
+/*    - Dispatch: the request to an idle worker, see "fcgi-pool.c"             */
+/*******************************************************************************/
+static int use_worker(fcgi_request * request) {
+  fcgi_buffer frames = { NULL, 0, 0, 0 };
+  fcgi_worker * worker;
+
+  // The environment, then the FCGI_STDIN that arrived while the request was waiting
+  if (pool_frame(&frames, buffer_data(&request->env), buffer_length(&request->env)) != RETVAL_SUCCESS
+      || buffer_append(&frames, buffer_data(&request->stdin_queue), buffer_length(&request->stdin_queue)) != RETVAL_SUCCESS) {
+    buffer_free(&frames);
+    return RETVAL_MEMORY_ERR;
+  }
+  free_env(request);
+  buffer_free(&request->stdin_queue);
+  request->stdin_queue = frames;
+
+  worker = pool_acquire(request);
+  return_error(worker == NULL, RETVAL_OTHER);
+  request->worker = worker;
+  request->spawned = stats_now();
+
+  event_add(&request->child_in, worker->to_worker, EVENT_WRITE, stdin_handler, request);
+  event_add(&request->child_out, worker->from_worker, EVENT_READ, stdout_handler, request);
+  return RETVAL_SUCCESS;
+}
+
+
+/*******************************************************************************/
+/*    - Call:    the handler plugin, in-process, see "fcgi-plugin.c"           */
+/*                                                                             */
+/*  The body is read from the spool, see config.spool_memory, and the output   */
+/*  is coalesced as that of a child, up to its end, when the handler returns.  */
+/*******************************************************************************/
+typedef struct {
+  fcgi_plugin_io io;
+  fcgi_request * request;
+} request_io;
+
+
+static ssize_t request_read(fcgi_plugin_io * io, void * buffer, size_t length) {
+  fcgi_request * request = ((request_io *) io)->request;
+  ssize_t count;
+
+  if (request->spool_fd < 0) return 0;
+  do {
+    count = read(request->spool_fd, buffer, length);
+  } while (count < 0 && errno == EINTR);
+  return count;
+}
+
+
+static ssize_t request_write(fcgi_plugin_io * io, const void * data, size_t length) {
+  fcgi_request * request = ((request_io *) io)->request;
+  fcgi_buffer * pending = &request->stdout_pending;
+  const BYTE * p = (const BYTE *) data;
+  size_t count;
+
+  stats_count(STATS_STDOUT_BYTES, length);
+  for (; length != 0; length -= count, p += count) {
+    count = MAX_STDOUT_BUFFER - buffer_length(pending);
+    if (count > length) count = length;
+    return_error(buffer_append(pending, p, count) != RETVAL_SUCCESS, -1);
+
+    if (buffer_length(pending) >= (size_t) config.output_size || buffer_length(pending) == MAX_STDOUT_BUFFER) {
+      flush_stdout(request);
+    }
+  }
+  return p - (const BYTE *) data;
+}
+
+
+static int call_plugin(fcgi_request * request) {
+  request_io io = { { request_read, request_write }, request };
+  char ** env;
+
+  env = env_vector(request);
+  return_error(env == NULL, RETVAL_MEMORY_ERR);
+
+  request->spawned = stats_now();
+  request->status = plugin_handle(env, &io.io);
+  stats_since(STATS_EXIT, request->spawned);
+  close_spool(request);
+  free_env(request);
+
+  // As if the child had closed its stdout, and exited
+  flush_stdout(request);
+  if (request->authorizing) authorizer_respond(request);
+  connection_write_record(request->conn, FCGI_STDOUT, request->id, NULL, 0);
+  request->stdout_eof = NONZERO;
+  request->exited = NONZERO;
+  check_complete(request);
+  return RETVAL_SUCCESS;
+}
+
+
+
+/*******************************************************************************/
+/*    - Build:   "name=value", appended to the arena of the environment        */
+/*******************************************************************************/
+int responder_env(fcgi_request * request, const BYTE * name, int name_length,
+                  const BYTE * value, int value_length) {
+  BYTE * q;
+
+  take_env(request);
+
+  // An environment string ends at its first NUL
+  name_length = strnlen((const char *) name, name_length);
+  value_length = strnlen((const char *) value, value_length);
+
+  q = buffer_reserve(&request->env, name_length + 1 + value_length + 1);
+  return_error(q == NULL, RETVAL_MEMORY_ERR);
+
+  memcpy( q, name, name_length); q += name_length;
+  (*q) = '=' ; q++;
+  memcpy( q, value, value_length); q += value_length;
+  (*q) = '\0'; q++;
+
+  buffer_commit(&request->env, name_length + 1 + value_length + 1);
+  request->env_count ++;
+  return RETVAL_SUCCESS;
+}
+
+
+/*******************************************************************************/
+/*    - Receive: {FCGI_PARAMS, id, <string> }+                                 */
+/*    - Build:   Create the environment for the child process                  */
+/*                                                                             */
+/*  The PARAMS stream, including the start of a pair kept for the next record, */
+/*  is bounded by config.max_params_bytes: beyond it, the request ends with a  */
+/*  431 Status, as the body does on a bad length, see reject_body.             */
+/*******************************************************************************/
+#define PARAMS_TOO_LARGE_RESPONSE  "Status: 431 Request Header Fields Too Large\r\n" \
+                                   "Content-Type: text/plain\r\n\r\n" \
+                                   "The PARAMS of the request are too large.\r\n"
+
+int responder_params(fcgi_request * request, const BYTE * content, int content_length) {
+  const BYTE * p = content;                   // a walking pointer within the content
+  const BYTE * end = content + content_length;
+
+  int name_length;  const BYTE * name;     // The name component of the Name-Value pair
+  int value_length; const BYTE * value;    // The value component of the Name-Value pair
+  fcgi_buffer * pending = &request->params;
+  const char * length;
+  int retval;
+
+  /* A record of the form {PARAMS, id, ""} denotes end of PARAMS */
+  if (content_length == 0) {
+    return_error(buffer_length(pending) != 0, RETVAL_PROTOCOL_ERROR);
+    request->state = REQUEST_STDIN;
+    request->params_ended = stats_now();
+    stats_record(STATS_PARAMS, request->params_ended - request->began);
+    length = env_value(request, "CONTENT_LENGTH", 14);
+    request->content_length = (length != NULL && *length != '\0') ? atoll(length) : -1;
+
+    // The request ends after config.request_timeout, including its wait for a child
+    if (config.request_timeout != 0) {
+      timer_start(&request->timeout_timer, config.request_timeout, request_timeout, request);
+    }
+    if (request->role == FCGI_AUTHORIZER) return authorizer_start(request);
+    if (cache_replay(request)) return RETVAL_SUCCESS;
+
+    // A spooled body is received first, see spool_end
+    if (config.spool_memory != 0) return RETVAL_SUCCESS;
+    return admit_child(request);
+  }
+
+  request->params_length += content_length;
+  if (config.max_params_bytes != 0 && request->params_length > config.max_params_bytes) {
+    reject_body(request, PARAMS_TOO_LARGE_RESPONSE);
+    return RETVAL_SUCCESS;
+  }
+
+  // A Name-Value pair may span records: its start is kept from the previous record
+  if (buffer_length(pending) != 0) {
+    return_error(buffer_append(pending, content, content_length) != RETVAL_SUCCESS, RETVAL_MEMORY_ERR);
+    p = buffer_data(pending);
+    end = p + buffer_length(pending);
+  }
+
+  while (p < end) {
+    retval = fcgi_decode_pair(&p, end, &name, &name_length, &value, &value_length);
+    if (retval == RETVAL_PARTIAL) break;
+    return_error(retval != RETVAL_SUCCESS, retval);
+
+    retval = responder_env(request, name, name_length, value, value_length);
+    return_error(retval != RETVAL_SUCCESS, retval);
+  }
+
+  // Keep the start of the pair that continues in the next record
+  if (buffer_length(pending) != 0) {
+    buffer_consume(pending, p - buffer_data(pending));
+  } else if (p < end) {
+    return_error(buffer_append(pending, p, end - p) != RETVAL_SUCCESS, RETVAL_MEMORY_ERR);
+  }
+  return RETVAL_SUCCESS;
+}
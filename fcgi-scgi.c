@@ -0,0 +1,146 @@
+/*******************************************************************************/
+/*  SCGI connections:                                                          */
+/*     - a connection carries a single request: a netstring of headers,        */
+/*       followed by a body of CONTENT_LENGTH bytes                            */
+/*     - the response is the output of the CGI program, as is, after which     */
+/*       the connection is closed                                              */
+/*                                                                             */
+/*  The request is served by the same connection, responder and children as    */
+/*  an FCGI request, see "fcgi-connection.c":                                  */
+/*     - the headers are the FCGI_PARAMS, see responder_env                    */
+/*     - the body is the content of FCGI_STDIN, i.e., it is received in parts, */
+/*       and spliced into the pipe to the child, as usual                      */
+/*     - the FCGI_STDOUT is sent without record headers, and the other         */
+/*       records are dropped, see connection_commit_record                     */
+/*                                                                             */
+/*******************************************************************************/
+/* SCGI Protocol Definition: https://python.ca/scgi/protocol.txt               */
+/*                                                                             */
+/*    netstring = [len]":"[string]","                                          */
+/*    headers   = header*                                                      */
+/*    header    = [name] NUL [value] NUL                                       */
+/*                                                                             */
+/*    - the first header is CONTENT_LENGTH                                     */
+/*    - the header "SCGI" with the value "1" is required                       */
+/*    - duplicate names are not allowed                                        */
+/*                                                                             */
+/*******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fcgi-daemon.h"
+
+
+#define SCGI_MAX_HEADERS    (1024 * 1024)   // The length of the netstring
+#define SCGI_REQUEST_ID     (1)
+
+
+// The headers, which are complete, become the PARAMS of a new request
+static int scgi_headers(fcgi_connection * conn, const BYTE * p, const BYTE * end) {
+  fcgi_request * request;
+  const BYTE * name;
+  const BYTE * value;
+  const BYTE * next;
+  long long content_length = -1;
+  int scgi = ZERO;
+  int retval;
+
+  retval = connection_add_request(conn, SCGI_REQUEST_ID, FCGI_RESPONDER, ZERO, &request);
+  return_error(retval != RETVAL_SUCCESS, retval);
+
+  while (p < end) {
+    name = p;
+    value = memchr(name, '\0', end - name);
+    return_error(value == NULL, RETVAL_PROTOCOL_ERROR);
+    value++;
+    next = memchr(value, '\0', end - value);
+    return_error(next == NULL, RETVAL_PROTOCOL_ERROR);
+    next++;
+
+    if (content_length < 0) {
+      char * digits_end;
+
+      return_error(strcmp((const char *) name, "CONTENT_LENGTH") != 0, RETVAL_PROTOCOL_ERROR);
+      content_length = strtoll((const char *) value, &digits_end, 10);
+      return_error(*value == '\0' || *digits_end != '\0' || content_length < 0, RETVAL_PROTOCOL_ERROR);
+    }
+    if (strcmp((const char *) name, "SCGI") == 0) {
+      return_error(strcmp((const char *) value, "1") != 0, RETVAL_PROTOCOL_ERROR);
+      scgi = NONZERO;
+    }
+
+    retval = responder_env(request, name, value - name - 1, value, next - value - 1);
+    return_error(retval != RETVAL_SUCCESS, retval);
+    p = next;
+  }
+  return_error(content_length < 0 || ! scgi, RETVAL_PROTOCOL_ERROR);
+
+  // The body is the content of FCGI_STDIN
+  conn->parser.state = RECORD_CONTENT;
+  conn->parser.type = FCGI_STDIN;
+  conn->parser.request_id = SCGI_REQUEST_ID;
+  conn->parser.remaining = content_length;
+  conn->parser.padding = 0;
+  conn->scgi_state = (content_length == 0) ? SCGI_END : SCGI_BODY;
+
+  // The end of the PARAMS: the child is spawned, or the request ends
+  return responder_params(request, NULL, 0);
+}
+
+
+/*******************************************************************************/
+/* Return the next part of the body, as for record_next                        */
+/*    - RETVAL_SUCCESS:         a FCGI_STDIN record is returned                */
+/*    - RETVAL_PARTIAL:         more input is needed                           */
+/*    - RETVAL_PROTOCOL_ERROR:  the input is not an SCGI request               */
+/*******************************************************************************/
+int scgi_next(fcgi_connection * conn, fcgi_record * record) {
+  fcgi_buffer * input = &conn->input;
+  const BYTE * p;
+  const BYTE * end;
+  size_t length = 0;
+  int retval;
+
+  if (conn->scgi_state == SCGI_HEADERS) {
+    p = buffer_data(input);
+    end = p + buffer_length(input);
+
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+      length = length * 10 + (*p - '0');
+      return_error(length > SCGI_MAX_HEADERS, RETVAL_PROTOCOL_ERROR);
+    }
+    if (p == end) return RETVAL_PARTIAL;
+    return_error(p == buffer_data(input) || *p != ':', RETVAL_PROTOCOL_ERROR);
+    p++;
+
+    if ((size_t) (end - p) < length + 1) return RETVAL_PARTIAL;
+    return_error(p[length] != ',', RETVAL_PROTOCOL_ERROR);
+
+    retval = scgi_headers(conn, p, p + length);
+    buffer_consume(input, p + length + 1 - buffer_data(input));
+    return_error(retval != RETVAL_SUCCESS, retval);
+  }
+
+  if (conn->scgi_state == SCGI_BODY) {
+    // The rest of the body may have been spliced to the child
+    if (conn->parser.state == RECORD_CONTENT) return record_next(&conn->parser, input, record);
+    conn->scgi_state = SCGI_END;
+  }
+
+  if (conn->scgi_state == SCGI_END) {
+    // The empty FCGI_STDIN record
+    conn->scgi_state = SCGI_DONE;
+    conn->parser.consume = 0;
+    record->type = FCGI_STDIN;
+    record->request_id = SCGI_REQUEST_ID;
+    record->content = NULL;
+    record->content_length = 0;
+    record->part = ZERO;
+    return RETVAL_SUCCESS;
+  }
+
+  // Anything after the body is ignored
+  buffer_consume(input, buffer_length(input));
+  return RETVAL_PARTIAL;
+}
@@ -0,0 +1,212 @@
+/*******************************************************************************/
+/*  The shards of fcgi-launch -N: a process per CPU                            */
+/*     - each shard is a whole daemon: its own event loop, children, limits,   */
+/*       pool, zygote and cache, i.e., -c, -q, -P, -Z and -C are per shard     */
+/*     - each shard accepts on a listener of its own, bound with SO_REUSEPORT  */
+/*       to the same ADDR:PORT, so that the kernel spreads the connections     */
+/*       over the shards rather than queue them on a single accept queue       */
+/*     - with config.shard_affinity, shard i runs on the i-th CPU allowed      */
+/*                                                                             */
+/*  The listeners are created by the supervisor, i.e., the process that forks  */
+/*  the shards: a shard that exits is replaced, and the connections queued on  */
+/*  its listener are then accepted by its replacement.  The supervisor ends    */
+/*  the shards on SIGTERM, SIGINT or SIGHUP, and a shard ends with it.         */
+/*                                                                             */
+/*  The statistics of the shards are in shared memory, a slot each: the first  */
+/*  shard reports their rollup, and the load of each, see stats_rollup.        */
+/*  The gauges of a slot, e.g., its open connections, are refreshed every      */
+/*  SHARD_GAUGES_INTERVAL.                                                     */
+/*                                                                             */
+/*******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include "fcgi-daemon.h"
+
+
+#define SHARD_RESPAWN_DELAY   (1000)    // A shard that exits sooner is replaced after this delay
+#define SHARD_GAUGES_INTERVAL (100)
+
+
+typedef struct {
+  pid_t pid;                    // -1 while the shard is to be replaced
+  long long started;            // See event_now
+  long long respawn;            // ... the replacement is due at this time, see SHARD_RESPAWN_DELAY
+} fcgi_shard;
+
+static fcgi_shard * shards = NULL;
+static fcgi_stats * slots = NULL;      // The statistics of the shards, in shared memory
+static sigset_t signals;                // Those of the supervisor, i.e., blocked in the shards
+static sigset_t original_mask;
+static pid_t supervisor;
+static fcgi_timer gauges_timer;
+
+
+// The CPUs this process may run on
+int shard_cpus(void) {
+  cpu_set_t cpus;
+
+  if (sched_getaffinity(0, sizeof(cpus), &cpus) != 0) return 1;
+  return CPU_COUNT(&cpus);
+}
+
+
+// Run on the "index"-th CPU allowed, modulo their count
+static void bind_cpu(int index) {
+  cpu_set_t cpus;
+  cpu_set_t cpu;
+  int i;
+
+  if (sched_getaffinity(0, sizeof(cpus), &cpus) != 0) return;
+  index %= CPU_COUNT(&cpus);
+
+  for (i = 0; i < CPU_SETSIZE; i++) {
+    if (! CPU_ISSET(i, &cpus) || index-- != 0) continue;
+    CPU_ZERO(&cpu);
+    CPU_SET(i, &cpu);
+    sched_setaffinity(0, sizeof(cpu), &cpu);
+    return;
+  }
+}
+
+
+static void refresh_gauges(fcgi_timer * timer) {
+  stats_gauges(stats);
+  timer_start(&gauges_timer, SHARD_GAUGES_INTERVAL, refresh_gauges, NULL);
+}
+
+
+
+/*******************************************************************************/
+/* Forking a shard: returns 0 in the supervisor, or 1 in the shard             */
+/*******************************************************************************/
+static int fork_shard(int index) {
+  pid_t pid = fork();
+
+  if (pid < 0) {
+    shards[index].pid = -1;
+    shards[index].respawn = event_now() + SHARD_RESPAWN_DELAY;
+    return ZERO;
+  }
+  if (pid > 0) {
+    shards[index].pid = pid;
+    shards[index].started = event_now();
+    return ZERO;
+  }
+
+  // A shard ends with its supervisor
+  sigprocmask(SIG_SETMASK, &original_mask, NULL);
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  if (getppid() != supervisor) _exit(0);
+
+  if (config.shard_affinity) bind_cpu(index);
+  stats = &slots[index];
+  stats_gauges(stats);
+  timer_start(&gauges_timer, SHARD_GAUGES_INTERVAL, refresh_gauges, NULL);
+
+  // The first shard reports the statistics of all of them
+  if (index == 0) {
+    stats_rollup(slots, config.shards);
+  } else {
+    config.stats_file = NULL;
+    config.stats_socket = NULL;
+  }
+  return NONZERO;
+}
+
+
+// A shard has exited: it is replaced, at once unless it failed as it started
+static void shard_exited(pid_t pid) {
+  int i;
+
+  for (i = 0; i < config.shards; i++) {
+    if (shards[i].pid != pid) continue;
+
+    shards[i].pid = -1;
+    shards[i].respawn = shards[i].started + SHARD_RESPAWN_DELAY;
+    memset(slots[i].gauges, ZERO, sizeof(slots[i].gauges));
+    return;
+  }
+}
+
+
+static void shutdown_shards(void) {
+  int i;
+
+  for (i = 0; i < config.shards; i++) {
+    if (shards[i].pid > 0) kill(shards[i].pid, SIGTERM);
+  }
+  exit(0);
+}
+
+
+/*******************************************************************************/
+/* Start config.shards shards, and supervise them                              */
+/*    - returns the index of the shard, in each shard, or 0 without shards     */
+/*    - the supervisor itself does not return                                  */
+/*******************************************************************************/
+int shard_start(void) {
+  siginfo_t info;
+  struct timespec timeout;
+  long long now;
+  long long due;
+  pid_t pid;
+  int status;
+  int i;
+
+  if (config.shards == 0) return 0;
+
+  shards = (fcgi_shard *) calloc(config.shards, sizeof(fcgi_shard));
+  slots = mmap(NULL, config.shards * sizeof(fcgi_stats), PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  exit_error(shards == NULL || slots == MAP_FAILED, RETVAL_MEMORY_ERR);
+
+  // The signals are received synchronously, see sigtimedwait
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGCHLD);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGHUP);
+  sigprocmask(SIG_BLOCK, &signals, &original_mask);
+  supervisor = getpid();
+
+  for (i = 0; i < config.shards; i++) {
+    if (fork_shard(i)) return i;
+  }
+
+  for (;;) {
+    now = event_now();
+    due = -1;
+    for (i = 0; i < config.shards; i++) {
+      if (shards[i].pid > 0) continue;
+      if (shards[i].respawn <= now) {
+        if (fork_shard(i)) return i;
+      }
+      if (shards[i].pid < 0 && (due < 0 || shards[i].respawn < due)) due = shards[i].respawn;
+    }
+
+    if (due < 0) {
+      status = sigwaitinfo(&signals, &info);
+    } else {
+      due = (due > now) ? due - now : 0;
+      timeout.tv_sec = due / 1000;
+      timeout.tv_nsec = (due % 1000) * 1000000;
+      status = sigtimedwait(&signals, &info, &timeout);
+    }
+    if (status < 0) continue;         // EAGAIN: a shard is due, or EINTR
+
+    if (status != SIGCHLD) shutdown_shards();
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) shard_exited(pid);
+  }
+}
@@ -0,0 +1,487 @@
+/*******************************************************************************/
+/*  Spawning the CGI program:                                                  */
+/*     - via posix_spawn(), i.e., clone(CLONE_VM | CLONE_VFORK): the address  */
+/*       space of the daemon is not copied, so that the cost of a spawn does  */
+/*       not grow with the cache, the arenas and the connections               */
+/*     - or, with config.zygote, via a small helper process that is forked    */
+/*       at startup, and forks each child on request over a Unix socket        */
+/*                                                                             */
+/*  The pipes of the child become its stdin, stdout and, unless it keeps that  */
+/*  of the daemon, stderr.  Its signal mask is emptied, and SIGPIPE restored,  */
+/*  as expected by a CGI program.  It leads a process group of its own, so     */
+/*  that the processes it starts are terminated along with it, see             */
+/*  spawn_terminate.                                                           */
+/*                                                                             */
+/*  The children of the zygote are reaped by the zygote, which reports their   */
+/*  exit to the daemon, see responder_exited.  Should the zygote exit, the     */
+/*  daemon is their subreaper, and the spawns fall back to posix_spawn().      */
+/*                                                                             */
+/*  The reply of the zygote is not waited for: the event loop goes on, and     */
+/*  the reply is passed to the handler of the spawn, in the order of the       */
+/*  spawns.  Without a reply within ZYGOTE_TIMEOUT, the zygote is killed, its  */
+/*  children are reparented to the daemon, the spawns that await a reply fail  */
+/*  with EAGAIN, and a new zygote is started, see reply_timeout.  A spawn      */
+/*  without a handler, e.g., of a worker of the pool, is a posix_spawn().      */
+/*                                                                             */
+/*******************************************************************************/
+/* The zygote protocol, on a SOCK_SEQPACKET socket pair:                       */
+/*                                                                             */
+/*    daemon -> zygote:  the environment, "name=value" NUL, repeated, with     */
+/*                       the stdin, stdout and stderr of the child, or only    */
+/*                       the first two, as SCM_RIGHTS                          */
+/*    zygote -> daemon:  { ZYGOTE_SPAWNED, pid, errno }, in reply              */
+/*                       { ZYGOTE_EXITED, pid, status }, once reaped           */
+/*                                                                             */
+/*******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/prctl.h>
+
+#include "fcgi-daemon.h"
+
+
+#define ZYGOTE_SPAWNED    (1)
+#define ZYGOTE_EXITED     (2)
+#define ZYGOTE_TIMEOUT    (1000)      // The reply to a spawn, in milliseconds
+#define ZYGOTE_MAX_ENV    (1024)      // The strings of a request, see IOV_MAX
+
+typedef struct {
+  int type;
+  pid_t pid;
+  int value;                          // The errno, or the status of waitpid()
+} zygote_message;
+
+typedef struct {
+  pid_t pid;
+  long long deadline;                 // Of the SIGKILL, see event_now
+} spawn_victim;
+
+typedef struct {
+  fcgi_spawn_handler handler;
+  void * data;                        // NULL once cancelled, see spawn_cancel
+  long long deadline;                 // Of the reply, see event_now
+} zygote_spawn_reply;
+
+static posix_spawnattr_t attributes;
+
+static pid_t zygote_pid = -1;
+static fcgi_event zygote;             // The socket to the zygote, fd -1 if none
+static fcgi_buffer replies;           // The zygote_spawn_replies awaited, in order
+static fcgi_timer reply_timer;
+
+static fcgi_buffer victims;           // The children sent SIGTERM, by deadline
+static fcgi_timer kill_timer;
+
+
+
+/*******************************************************************************/
+/* posix_spawn()                                                               */
+/*******************************************************************************/
+static pid_t spawn_direct(char ** env, int stdin_fd, int stdout_fd, int stderr_fd) {
+  posix_spawn_file_actions_t actions;
+  char * argv[] = { config.program, NULL };
+  pid_t pid;
+  int error;
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, stdin_fd, 0);
+  posix_spawn_file_actions_adddup2(&actions, stdout_fd, 1);
+  if (stderr_fd >= 0) posix_spawn_file_actions_adddup2(&actions, stderr_fd, 2);
+
+  error = posix_spawn(&pid, config.program, &actions, &attributes, argv, env);
+  posix_spawn_file_actions_destroy(&actions);
+
+  if (error != 0) {
+    errno = error;
+    return -1;
+  }
+  return pid;
+}
+
+
+
+/*******************************************************************************/
+/* The zygote process                                                          */
+/*******************************************************************************/
+static void zygote_send(int sock, int type, pid_t pid, int value) {
+  zygote_message message = { type, pid, value };
+
+  while (send(sock, &message, sizeof(message), MSG_NOSIGNAL) < 0 && errno == EINTR) ;
+}
+
+
+static void zygote_fork(int sock, BYTE * data, size_t length, int fds[3], int fd_count) {
+  char * env[ZYGOTE_MAX_ENV + 1];
+  size_t i;
+  int count = 0;
+  pid_t pid;
+
+  for (i = 0; i < length && count < ZYGOTE_MAX_ENV; i += strlen((char *) data + i) + 1) {
+    env[count++] = (char *) data + i;
+  }
+  env[count] = NULL;
+
+  pid = fork();
+  if (pid == SELF) {
+    sigset_t mask;
+
+    dup2(fds[0], 0);
+    dup2(fds[1], 1);
+    if (fd_count == 3) dup2(fds[2], 2);
+    setpgid(0, 0);
+
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    signal(SIGPIPE, SIG_DFL);
+
+    execle(config.program, config.program, (char *) NULL, env);
+    _exit(RETVAL_UNABLE_TO_EXEC);
+  }
+  // As the child does, so that its group exists once the daemon has its pid
+  if (pid > 0) setpgid(pid, pid);
+  close(fds[0]); close(fds[1]);
+  if (fd_count == 3) close(fds[2]);
+  zygote_send(sock, ZYGOTE_SPAWNED, pid, (pid < 0) ? errno : 0);
+}
+
+
+static void zygote_main(int sock) {
+  struct pollfd polls[2];
+  sigset_t mask;
+  BYTE * data = NULL;
+  size_t size = 0;
+  int fd;
+
+  // Only the socket of the daemon is kept, e.g., not its listeners
+  for (fd = 3; fd < sock; fd++) close(fd);
+  close_range(sock + 1, ~0U, 0);
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+  polls[0].fd = sock;
+  polls[0].events = POLLIN;
+  polls[1].fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  polls[1].events = POLLIN;
+  exit_error(polls[1].fd < 0, RETVAL_OTHER);
+
+  for (;;) {
+    if (poll(polls, 2, -1) < 0 && errno != EINTR) _exit(RETVAL_OTHER);
+
+    if (polls[1].revents != 0) {
+      struct signalfd_siginfo info;
+      pid_t pid;
+      int status;
+
+      while (read(polls[1].fd, &info, sizeof(info)) == sizeof(info)) ;
+      while ((pid = waitpid(-1, &status, WNOHANG)) > 0) zygote_send(sock, ZYGOTE_EXITED, pid, status);
+    }
+
+    if (polls[0].revents != 0) {
+      char control[CMSG_SPACE(3 * sizeof(int))];
+      struct msghdr header;
+      struct cmsghdr * cmsg;
+      struct iovec iov;
+      ssize_t length;
+      int fds[3];
+      int fd_count;
+
+      // The length of the next request, which is then received whole
+      length = recv(sock, NULL, 0, MSG_PEEK | MSG_TRUNC);
+      if (length <= 0) {
+        if (length < 0 && errno == EINTR) continue;
+        _exit(0);               // The daemon has exited
+      }
+      if ((size_t) length + 1 > size) {
+        size = length + 1;
+        data = (BYTE *) realloc(data, size);
+        exit_error(data == NULL, RETVAL_MEMORY_ERR);
+      }
+
+      iov.iov_base = data;
+      iov.iov_len = length;
+      memset(&header, ZERO, sizeof(header));
+      header.msg_iov = &iov;
+      header.msg_iovlen = 1;
+      header.msg_control = control;
+      header.msg_controllen = sizeof(control);
+      length = recvmsg(sock, &header, MSG_CMSG_CLOEXEC);
+      if (length <= 0) continue;
+      data[length] = '\0';
+
+      cmsg = CMSG_FIRSTHDR(&header);
+      fd_count = (cmsg == NULL) ? 0 : (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || fd_count < 2 || fd_count > 3) {
+        zygote_send(sock, ZYGOTE_SPAWNED, -1, EINVAL);
+        continue;
+      }
+      memcpy(fds, CMSG_DATA(cmsg), fd_count * sizeof(int));
+      zygote_fork(sock, data, length, fds, fd_count);
+    }
+  }
+}
+
+
+
+/*******************************************************************************/
+/* The daemon's side of the zygote                                             */
+/*******************************************************************************/
+// The reply to the oldest spawn, or its failure: NULL if it was cancelled
+static void zygote_reply(pid_t pid, int error) {
+  zygote_spawn_reply reply = *(zygote_spawn_reply *) buffer_data(&replies);
+
+  buffer_consume(&replies, sizeof(zygote_spawn_reply));
+  reply.handler(reply.data, pid, error);
+}
+
+
+static void zygote_close(void) {
+  int fd = zygote.fd;
+
+  if (fd < 0) return;
+  event_remove(&zygote);
+  close(fd);
+
+  timer_stop(&reply_timer);
+  while (buffer_length(&replies) != 0) zygote_reply(-1, EAGAIN);
+}
+
+
+static int zygote_start(void);
+static void zygote_receive(void);
+
+
+// The oldest spawn has not been replied to: the zygote is hung.  It is killed,
+// and reaped, so that its children are reparented to the daemon; the messages
+// it sent before are received, the spawns still without a reply fail, which
+// releases their children_running, and a new zygote is started.
+static void reply_timeout(fcgi_timer * timer) {
+  if (zygote_pid > 0) {
+    kill(zygote_pid, SIGKILL);
+    while (waitpid(zygote_pid, NULL, 0) < 0 && errno == EINTR) ;
+    zygote_pid = -1;
+  }
+  if (zygote.fd >= 0) zygote_receive();
+  zygote_close();
+
+  if (zygote_start() != RETVAL_SUCCESS) zygote_close();
+  responder_admit();
+}
+
+
+static void reply_wait(void) {
+  zygote_spawn_reply * reply = (zygote_spawn_reply *) buffer_data(&replies);
+  long long delay;
+
+  timer_stop(&reply_timer);
+  if (buffer_length(&replies) == 0) return;
+
+  delay = reply->deadline - event_now();
+  timer_start(&reply_timer, (delay > 0) ? (int) delay : 0, reply_timeout, NULL);
+}
+
+
+// The messages of the zygote, until none is left, or the zygote has exited
+static void zygote_receive(void) {
+  zygote_message message;
+  ssize_t count;
+
+  while ((count = recv(zygote.fd, &message, sizeof(message), MSG_DONTWAIT)) == sizeof(message)) {
+    if (message.type == ZYGOTE_EXITED) {
+      responder_exited(message.pid, message.value);
+    } else if (buffer_length(&replies) != 0) {
+      zygote_reply(message.pid, (message.pid < 0) ? message.value : 0);
+      reply_wait();
+    }
+  }
+  if (count == 0 || (count < 0 && errno != EAGAIN && errno != EINTR)) zygote_close();
+}
+
+
+static void zygote_handler(fcgi_event * event, int ready) {
+  zygote_receive();
+  responder_admit();
+}
+
+
+// Returns 0 once the request is sent: the reply is passed to "handler"
+static pid_t zygote_spawn(char ** env, int stdin_fd, int stdout_fd, int stderr_fd,
+                          fcgi_spawn_handler handler, void * data) {
+  struct iovec iov[ZYGOTE_MAX_ENV];
+  char control[CMSG_SPACE(3 * sizeof(int))];
+  int fd_count = (stderr_fd >= 0) ? 3 : 2;
+  zygote_spawn_reply reply = { handler, data, event_now() + ZYGOTE_TIMEOUT };
+  struct msghdr header;
+  struct cmsghdr * cmsg;
+  int count;
+
+  for (count = 0; env[count] != NULL; count++) {
+    if (count == ZYGOTE_MAX_ENV) return spawn_direct(env, stdin_fd, stdout_fd, stderr_fd);
+    iov[count].iov_base = env[count];
+    iov[count].iov_len = strlen(env[count]) + 1;
+  }
+  return_error(buffer_append(&replies, &reply, sizeof(reply)) != RETVAL_SUCCESS, -1);
+
+  memset(&header, ZERO, sizeof(header));
+  memset(control, ZERO, sizeof(control));
+  header.msg_iov = iov;
+  header.msg_iovlen = count;
+  header.msg_control = control;
+  header.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+  cmsg = CMSG_FIRSTHDR(&header);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), (int[]) { stdin_fd, stdout_fd, stderr_fd }, fd_count * sizeof(int));
+
+  // An environment that is too large for a message, e.g., is spawned directly
+  if (sendmsg(zygote.fd, &header, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+    replies.end -= sizeof(reply);
+    return spawn_direct(env, stdin_fd, stdout_fd, stderr_fd);
+  }
+
+  if (! reply_timer.active) reply_wait();
+  return 0;
+}
+
+
+static int zygote_start(void) {
+  int sockets[2];
+
+  return_error(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) != 0, RETVAL_OTHER);
+
+  zygote_pid = fork();
+  if (zygote_pid == SELF) {
+    close(sockets[0]);
+    zygote_main(sockets[1]);
+  }
+  close(sockets[1]);
+  if (zygote_pid < 0) {
+    close(sockets[0]);
+    return RETVAL_OTHER;
+  }
+
+  // The children of a zygote that exits are reparented to the daemon
+  prctl(PR_SET_CHILD_SUBREAPER, 1);
+  return_error(event_add(&zygote, sockets[0], EVENT_READ, zygote_handler, NULL) != RETVAL_SUCCESS, RETVAL_OTHER);
+  event_edge(&zygote);
+  return RETVAL_SUCCESS;
+}
+
+
+
+/*******************************************************************************/
+/* Spawn the CGI program: returns the pid of the child, or -1 and errno        */
+/*    - a "stderr_fd" of -1 keeps the stderr of the daemon                     */
+/*    - with the zygote, and a "handler", 0: the pid, or -1 and the errno, is  */
+/*      passed to handler(data, pid, error) once the zygote replies            */
+/*******************************************************************************/
+pid_t spawn_program(char ** env, int stdin_fd, int stdout_fd, int stderr_fd,
+                    fcgi_spawn_handler handler, void * data) {
+  if (zygote.fd >= 0 && handler != NULL) return zygote_spawn(env, stdin_fd, stdout_fd, stderr_fd, handler, data);
+  return spawn_direct(env, stdin_fd, stdout_fd, stderr_fd);
+}
+
+
+// The reply is no longer of interest: it is passed to the handler with NULL
+void spawn_cancel(void * data) {
+  zygote_spawn_reply * reply = (zygote_spawn_reply *) buffer_data(&replies);
+  zygote_spawn_reply * end = (zygote_spawn_reply *) (replies.data + replies.end);
+
+  for ( ; reply < end; reply++) {
+    if (reply->data == data) reply->data = NULL;
+  }
+}
+
+
+// A child has been reaped by the daemon: returns whether it was the zygote
+int spawn_reaped(pid_t pid) {
+  if (pid != zygote_pid) return ZERO;
+
+  zygote_pid = -1;
+  zygote_close();
+  return NONZERO;
+}
+
+
+
+/*******************************************************************************/
+/* Terminate a child, e.g., of a request that ends early                       */
+/*    - its process group is sent SIGTERM at once, then SIGKILL after          */
+/*      config.kill_grace milliseconds, unless the child has exited by then    */
+/*    - once the child is reaped, its pid may be reused: it is forgotten, see  */
+/*      spawn_exited                                                           */
+/*******************************************************************************/
+static void kill_timeout(fcgi_timer * timer) {
+  spawn_victim * victim;
+  long long now = event_now();
+
+  while (buffer_length(&victims) >= sizeof(spawn_victim)) {
+    victim = (spawn_victim *) buffer_data(&victims);
+    if (victim->deadline > now) {
+      timer_start(&kill_timer, victim->deadline - now, kill_timeout, NULL);
+      return;
+    }
+    kill(-victim->pid, SIGKILL);
+    stats_count(STATS_KILLED, 1);
+    buffer_consume(&victims, sizeof(spawn_victim));
+  }
+}
+
+
+void spawn_terminate(pid_t pid) {
+  spawn_victim victim = { pid, event_now() + config.kill_grace };
+
+  kill(-pid, SIGTERM);
+  stats_count(STATS_TERMINATED, 1);
+  if (buffer_append(&victims, &victim, sizeof(victim)) != RETVAL_SUCCESS) return;
+  if (! kill_timer.active) timer_start(&kill_timer, config.kill_grace, kill_timeout, NULL);
+}
+
+
+// A child has been reaped, see responder_exited
+void spawn_exited(pid_t pid) {
+  spawn_victim * victim = (spawn_victim *) buffer_data(&victims);
+  spawn_victim * end = (spawn_victim *) (victims.data + victims.end);
+
+  for ( ; victim < end; victim++) {
+    if (victim->pid != pid) continue;
+    memmove(victim, victim + 1, (end - victim - 1) * sizeof(spawn_victim));
+    victims.end -= sizeof(spawn_victim);
+    return;
+  }
+}
+
+
+int spawn_init(void) {
+  sigset_t mask;
+
+  sigemptyset(&mask);
+  posix_spawnattr_init(&attributes);
+  posix_spawnattr_setsigmask(&attributes, &mask);
+  sigaddset(&mask, SIGPIPE);
+  posix_spawnattr_setsigdefault(&attributes, &mask);
+  posix_spawnattr_setpgroup(&attributes, 0);
+  posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+  zygote.fd = -1;
+  if (config.zygote) return zygote_start();
+  return RETVAL_SUCCESS;
+}
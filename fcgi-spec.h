@@ -62,6 +62,10 @@ typedef struct {
 #define FCGI_NULL_REQUEST_ID     0
 
 
+// FCGI_BeginRequestBody flags
+#define FCGI_KEEP_CONN  1
+
+
 // FCGI roles
 #define FCGI_RESPONDER      1
 #define FCGI_AUTHORIZER     2
@@ -74,6 +78,17 @@ typedef struct {
 #define FCGI_UNKNOWN_ROLE     3
 
 
+// Variable names for FCGI_GET_VALUES / FCGI_GET_VALUES_RESULT records
+#define FCGI_MAX_CONNS  "FCGI_MAX_CONNS"
+#define FCGI_MAX_REQS   "FCGI_MAX_REQS"
+#define FCGI_MPXS_CONNS "FCGI_MPXS_CONNS"
+
+typedef struct {
+    unsigned char type;
+    unsigned char reserved[7];
+} FCGI_UnknownTypeBody;
+
+
 typedef struct {
   unsigned char nameLengthB0;  /* nameLengthB0  >> 7 == 0 */
   unsigned char valueLengthB0; /* valueLengthB0 >> 7 == 0 */
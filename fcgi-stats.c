@@ -0,0 +1,355 @@
+/*******************************************************************************/
+/*  Statistics:                                                                */
+/*     - counters of connections, requests, records and bytes                  */
+/*     - a latency histogram for each phase of a request, in microseconds of   */
+/*       the monotonic clock, see STATS_PARAMS ... STATS_REQUEST               */
+/*                                                                             */
+/*  The histograms are log-linear, as HdrHistogram: each power of two is       */
+/*  divided into HISTOGRAM_SUB buckets, i.e., a value is recorded within about */
+/*  3% of its magnitude, in constant time and memory.                          */
+/*                                                                             */
+/*  The statistics are reported in JSON:                                       */
+/*     - to config.stats_file, rewritten every config.stats_interval ms        */
+/*     - to each client that connects to the Unix socket config.stats_socket   */
+/*                                                                             */
+/*  With fcgi-launch -N, each shard keeps its statistics in memory shared with */
+/*  the others, and the first shard reports their rollup, see stats_rollup.    */
+/*                                                                             */
+/*******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "fcgi-daemon.h"
+
+
+static fcgi_stats own_stats;
+fcgi_stats * stats = &own_stats;
+
+static long long started;               // See stats_now
+static fcgi_stats * shards = NULL;      // The statistics of the shards, see stats_rollup
+static int shard_count = 0;
+static fcgi_stats rollup;
+static fcgi_timer stats_timer;          // Rewrites config.stats_file
+static fcgi_event stats_listener;       // Accepts on config.stats_socket
+
+
+static const char * counter_names[STATS_COUNTERS] = {
+  "connections", "requests", "records_in", "records_out", "bytes_in", "bytes_out",
+  "stdin_bytes", "stdout_bytes", "spawns", "spawn_errors",
+  "request_complete", "overloaded", "unknown_role", "cache_hits", "cache_misses",
+  "stderr_bytes", "stderr_dropped", "aborted", "timed_out", "terminated", "killed",
+  "spool_bytes", "spool_files", "bad_length", "event_syscalls", "event_changes",
+  "refused", "auth_allowed", "auth_denied", "auth_hits", "auth_misses",
+  "plugin_calls"
+};
+
+static const char * histogram_names[STATS_HISTOGRAMS] = {
+  "params", "wait", "spawn", "first_output", "stdin", "stdout", "exit", "request", "output_blocked"
+};
+
+
+long long stats_now(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+
+/*******************************************************************************/
+/* Histograms                                                                  */
+/*    - values below 2 * HISTOGRAM_SUB have a bucket each                       */
+/*    - above that, [2^m, 2^(m+1)) is divided into HISTOGRAM_SUB buckets        */
+/*******************************************************************************/
+static int bucket_index(long long value) {
+  int shift;
+
+  if (value < 2 * HISTOGRAM_SUB) return (int) value;
+
+  shift = (63 - __builtin_clzll((unsigned long long) value)) - HISTOGRAM_SUB_BITS;
+  if (shift >= HISTOGRAM_BUCKETS / HISTOGRAM_SUB - 1) return HISTOGRAM_BUCKETS - 1;
+  return (shift + 1) * HISTOGRAM_SUB + (int) ((value >> shift) - HISTOGRAM_SUB);
+}
+
+
+// The highest value recorded in the bucket
+static long long bucket_value(int index) {
+  int shift;
+
+  if (index < 2 * HISTOGRAM_SUB) return index;
+
+  shift = index / HISTOGRAM_SUB - 1;
+  return (((long long) (index % HISTOGRAM_SUB + HISTOGRAM_SUB) + 1) << shift) - 1;
+}
+
+
+void stats_record(int histogram, long long value) {
+  fcgi_histogram * h = &stats->histograms[histogram];
+
+  if (value < 0) value = 0;
+  if (h->count == 0 || value < h->min) h->min = value;
+  if (value > h->max) h->max = value;
+  h->count ++;
+  h->sum += value;
+  h->buckets[bucket_index(value)] ++;
+}
+
+
+// Record the time since "start", if it is known
+void stats_since(int histogram, long long start) {
+  if (start != 0) stats_record(histogram, stats_now() - start);
+}
+
+
+// The resident memory of the daemon, in kB, e.g., to compare with the spawn latency
+static long long resident_kb(void) {
+  long long pages = 0;
+  FILE * statm = fopen("/proc/self/statm", "r");
+
+  if (statm != NULL) {
+    if (fscanf(statm, "%*s %lld", &pages) != 1) pages = 0;
+    fclose(statm);
+  }
+  return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+
+static long long percentile(const fcgi_histogram * h, double fraction) {
+  long long rank = (long long) (fraction * h->count + 0.5);
+  long long seen = 0;
+  int i;
+
+  if (rank < 1) rank = 1;
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank) return (bucket_value(i) < h->max) ? bucket_value(i) : h->max;
+  }
+  return h->max;
+}
+
+
+// Add the statistics of "from", e.g., of another process, to "to"
+void stats_merge(fcgi_stats * to, const fcgi_stats * from) {
+  int i, j;
+
+  for (i = 0; i < STATS_COUNTERS; i++) to->counters[i] += from->counters[i];
+  for (i = 0; i < STATS_GAUGES; i++) to->gauges[i] += from->gauges[i];
+
+  for (i = 0; i < STATS_HISTOGRAMS; i++) {
+    fcgi_histogram * h = &to->histograms[i];
+    const fcgi_histogram * f = &from->histograms[i];
+
+    if (f->count == 0) continue;
+    if (h->count == 0 || f->min < h->min) h->min = f->min;
+    if (f->max > h->max) h->max = f->max;
+    h->count += f->count;
+    h->sum += f->sum;
+    for (j = 0; j < HISTOGRAM_BUCKETS; j++) h->buckets[j] += f->buckets[j];
+  }
+}
+
+
+// The gauges of this process, at the time of the report
+void stats_gauges(fcgi_stats * s) {
+  s->gauges[STATS_CONNECTIONS_OPEN] = connection_count;
+  s->gauges[STATS_CHILDREN_RUNNING] = children_running;
+  s->gauges[STATS_CHILDREN_WAITING] = children_waiting;
+  s->gauges[STATS_RSS_KB] = resident_kb();
+}
+
+
+// Report the sum of the statistics of "count" shards, rather than those of this process
+void stats_rollup(fcgi_stats * s, int count) {
+  shards = s;
+  shard_count = count;
+}
+
+
+
+/*******************************************************************************/
+/* The report, in JSON                                                         */
+/*******************************************************************************/
+static int append(fcgi_buffer * buffer, const char * format, ...)
+  __attribute__ ((format (printf, 2, 3)));
+
+static int append(fcgi_buffer * buffer, const char * format, ...) {
+  va_list args;
+  char line[256];
+  int length;
+
+  va_start(args, format);
+  length = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+
+  return buffer_append(buffer, line, length);
+}
+
+
+int stats_report(fcgi_buffer * report, const fcgi_stats * s) {
+  int retval = RETVAL_SUCCESS;
+  int i, j;
+
+  retval |= append(report, "{\n  \"uptime_us\": %lld,\n", stats_now() - started);
+  retval |= append(report, "  \"rss_kb\": %lld,\n", s->gauges[STATS_RSS_KB]);
+  retval |= append(report, "  \"connections_open\": %lld,\n", s->gauges[STATS_CONNECTIONS_OPEN]);
+  retval |= append(report, "  \"children_running\": %lld,\n", s->gauges[STATS_CHILDREN_RUNNING]);
+  retval |= append(report, "  \"children_waiting\": %lld,\n", s->gauges[STATS_CHILDREN_WAITING]);
+  retval |= append(report, "  \"event_backend\": \"%s\",\n", config.io_uring ? "io_uring" : "epoll");
+
+  retval |= append(report, "  \"counters\": {");
+  for (i = 0; i < STATS_COUNTERS; i++) {
+    retval |= append(report, "%s\n    \"%s\": %lld", (i == 0) ? "" : ",", counter_names[i], s->counters[i]);
+  }
+  retval |= append(report, "\n  },\n");
+
+  retval |= append(report, "  \"histograms_us\": {");
+  for (i = 0; i < STATS_HISTOGRAMS; i++) {
+    const fcgi_histogram * h = &s->histograms[i];
+    const char * separator = "";
+
+    retval |= append(report, "%s\n    \"%s\": { \"count\": %lld", (i == 0) ? "" : ",", histogram_names[i], h->count);
+    if (h->count != 0) {
+      retval |= append(report, ", \"min\": %lld, \"mean\": %lld, \"p50\": %lld, \"p90\": %lld,"
+                       " \"p99\": %lld, \"p999\": %lld, \"max\": %lld",
+                       h->min, h->sum / h->count, percentile(h, 0.5), percentile(h, 0.9),
+                       percentile(h, 0.99), percentile(h, 0.999), h->max);
+    }
+
+    // The non-empty buckets, as [highest value, count], e.g., to merge reports
+    retval |= append(report, ", \"buckets\": [");
+    for (j = 0; j < HISTOGRAM_BUCKETS; j++) {
+      if (h->buckets[j] == 0) continue;
+      retval |= append(report, "%s[%lld,%lld]", separator, bucket_value(j), h->buckets[j]);
+      separator = ",";
+    }
+    retval |= append(report, "] }");
+  }
+  retval |= append(report, "\n  }");
+
+  // The load of each shard, e.g., to check that the connections are spread
+  if (s == &rollup) {
+    retval |= append(report, ",\n  \"shards\": [");
+    for (i = 0; i < shard_count; i++) {
+      retval |= append(report, "%s\n    { \"connections_open\": %lld, \"children_running\": %lld,"
+                       " \"children_waiting\": %lld, \"rss_kb\": %lld, \"requests\": %lld }",
+                       (i == 0) ? "" : ",", shards[i].gauges[STATS_CONNECTIONS_OPEN],
+                       shards[i].gauges[STATS_CHILDREN_RUNNING], shards[i].gauges[STATS_CHILDREN_WAITING],
+                       shards[i].gauges[STATS_RSS_KB], shards[i].counters[STATS_REQUESTS]);
+    }
+    retval |= append(report, "\n  ]");
+  }
+  retval |= append(report, "\n}\n");
+
+  return (retval == RETVAL_SUCCESS) ? RETVAL_SUCCESS : RETVAL_MEMORY_ERR;
+}
+
+
+
+/*******************************************************************************/
+/* Exporting the report                                                        */
+/*    - the file is replaced atomically, via rename, so that it is never seen  */
+/*      partially written                                                      */
+/*    - a client of the socket receives the report, and then end-of-file       */
+/*******************************************************************************/
+// The statistics of this process, or the rollup of the shards
+static const fcgi_stats * current_stats(void) {
+  int i;
+
+  stats_gauges(stats);
+  if (shard_count == 0) return stats;
+
+  memset(&rollup, ZERO, sizeof(rollup));
+  for (i = 0; i < shard_count; i++) stats_merge(&rollup, &shards[i]);
+  return &rollup;
+}
+
+
+static void write_stats_file(fcgi_timer * timer) {
+  fcgi_buffer report = { NULL, 0, 0, 0 };
+  char temp[PATH_MAX];
+  int fd;
+
+  timer_start(&stats_timer, config.stats_interval, write_stats_file, NULL);
+
+  if (stats_report(&report, current_stats()) != RETVAL_SUCCESS) {
+    buffer_free(&report);
+    return;
+  }
+
+  snprintf(temp, sizeof(temp), "%s.tmp", config.stats_file);
+  fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd >= 0) {
+    ssize_t count = write(fd, buffer_data(&report), buffer_length(&report));
+
+    close(fd);
+    if (count == (ssize_t) buffer_length(&report)) rename(temp, config.stats_file);
+    else unlink(temp);
+  }
+  buffer_free(&report);
+}
+
+
+static void accept_stats(fcgi_event * event, int ready) {
+  fcgi_buffer report = { NULL, 0, 0, 0 };
+  int fd;
+
+  while ((fd = accept4(event->fd, NULL, NULL, SOCK_CLOEXEC)) >= 0 || errno == EINTR) {
+    if (fd < 0) continue;
+
+    if (buffer_length(&report) == 0) stats_report(&report, current_stats());
+    send(fd, buffer_data(&report), buffer_length(&report), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+  }
+  buffer_free(&report);
+}
+
+
+static int listen_stats(const char * path) {
+  struct sockaddr_un addr;
+  int fd;
+
+  return_error(strlen(path) >= sizeof(addr.sun_path), RETVAL_OTHER);
+  memset(&addr, ZERO, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  return_error(fd < 0, RETVAL_OTHER);
+
+  // A socket left by a previous daemon is replaced
+  unlink(path);
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+    close(fd);
+    return RETVAL_OTHER;
+  }
+  return_error(event_add(&stats_listener, fd, EVENT_READ, accept_stats, NULL) != RETVAL_SUCCESS, RETVAL_OTHER);
+  event_edge(&stats_listener);
+  return RETVAL_SUCCESS;
+}
+
+
+int stats_init(void) {
+  started = stats_now();
+
+  if (config.stats_file != NULL) {
+    timer_start(&stats_timer, config.stats_interval, write_stats_file, NULL);
+  }
+  if (config.stats_socket != NULL) {
+    return_error(listen_stats(config.stats_socket) != RETVAL_SUCCESS, RETVAL_OTHER);
+  }
+  return RETVAL_SUCCESS;
+}
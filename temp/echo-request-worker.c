@@ -0,0 +1,81 @@
+/*
+ * A worker of the pool, see fcgi-launch -P and the loop protocol in
+ * "fcgi-pool.c": it echoes the request line of each request, and its body,
+ * as echo-request.cgi does, without a process per request.
+ *
+ *     cc -o echo-request-worker echo-request-worker.c
+ *     fcgi-launch -P 4 127.0.0.1 9000 ./echo-request-worker
+ *
+ * The length of each chunk is written apart from its bytes, as a worker that
+ * does not buffer its output would, so that the daemon sees the framing alone.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// The next chunk, into *data, of its length: returns -1 at the end of stdin
+static long chunk(char ** data) {
+  char line[24];
+  long length;
+
+  if (fgets(line, sizeof(line), stdin) == NULL) return -1;
+  length = atol(line);
+
+  *data = realloc(*data, length + 1);
+  if (*data == NULL || fread(*data, 1, length, stdin) != (size_t) length) return -1;
+  (*data)[length] = '\0';
+  return length;
+}
+
+
+static void emit(const char * data, size_t length) {
+  char line[24];
+
+  if (length == 0) return;
+  write(1, line, snprintf(line, sizeof(line), "%zu\n", length));
+  write(1, data, length);
+}
+
+
+static const char * param(const char * env, long length, const char * name) {
+  const char * p;
+  size_t name_length = strlen(name);
+
+  for (p = env; p < env + length; p += strlen(p) + 1) {
+    if (strncmp(p, name, name_length) == 0 && p[name_length] == '=') return p + name_length + 1;
+  }
+  return "";
+}
+
+
+int main(void) {
+  char * env = NULL;
+  char * body = NULL;
+  char line[4096];
+  long env_length;
+  long length;
+
+  if (getenv("FCGI_WORKER") == NULL) {
+    fprintf(stderr, "Error: run by fcgi-launch -P, with FCGI_WORKER=1\n");
+    return 1;
+  }
+
+  while ((env_length = chunk(&env)) >= 0) {
+    // Emit response headers, and a blank line
+    emit("X-function: Echoing Request\nContent-type: text/plain\n\n", 54);
+
+    snprintf(line, sizeof(line), "%s %s %s\n\n", param(env, env_length, "REQUEST_METHOD"),
+             param(env, env_length, "REQUEST_URI"), param(env, env_length, "SERVER_PROTOCOL"));
+    emit(line, strlen(line));
+
+    // Emit body, as it comes, up to its zero-length chunk
+    while ((length = chunk(&body)) > 0) emit(body, length);
+    if (length < 0) return 0;
+
+    write(1, "0\n", 2);
+  }
+  return 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * A handler plugin that emits all of the CGI variables, as emit-cgi-env.cgi
+ * does, without a process per request, see "fcgi-plugin.h":
+ *
+ *     cc -shared -fPIC -I.. -o emit-cgi-env.so emit-cgi-env.c
+ *     fcgi-launch -p 127.0.0.1 9000 ./emit-cgi-env.so
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fcgi-plugin.h"
+
+
+static const char * names[] = {
+  "", "GATEWAY_INTERFACE", "",
+  "REQUEST_METHOD", "REQUEST_URI", "PATH_INFO", "QUERY_STRING", "SERVER_PROTOCOL", "HTTP_HOST", "",
+  "CONTENT_TYPE", "CONTENT_LENGTH", "",
+  "SERVER_NAME", "SERVER_PORT", "",
+  "SCRIPT_FILENAME", "SCRIPT_NAME", "",
+  "HTTP_USER_AGENT", "",
+  NULL
+};
+
+
+static const char * param(char ** params, const char * name) {
+  size_t length = strlen(name);
+
+  for (; *params != NULL; params++) {
+    if (strncmp(*params, name, length) == 0 && (*params)[length] == '=') return *params + length + 1;
+  }
+  return "";
+}
+
+
+int fcgi_handle(char ** params, fcgi_plugin_io * io) {
+  char line[4096];
+  int i;
+
+  // Emit response headers, and a blank line
+  io->write(io, "X-function: Emiting CGI variables\n", 34);
+  io->write(io, "Content-type: text/plain\n\n", 26);
+
+  // Emit body
+  io->write(io, "# CGI Defined Environment Variables\n", 36);
+  for (i = 0; names[i] != NULL; i++) {
+    if (*names[i] == '\0') {
+      io->write(io, "\n", 1);
+      continue;
+    }
+    snprintf(line, sizeof(line), "%s: %s\n", names[i], param(params, names[i]));
+    io->write(io, line, strlen(line));
+  }
+  return 0;
+}